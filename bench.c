@@ -0,0 +1,455 @@
+// Workload benchmark, builds on Linux with
+//
+//   cc -O2 -std=gnu11 -DVALIDATE=0 -o bench bench.c hash.c scan.c epoch.c sharded.c file.c pool.c debug.c -lm
+//
+// It loads a table of -n entries, then runs -o operations and prints one JSON line per phase,
+// so runs of two versions can be diffed or fed to a script.
+//
+//   -k          keys picked uniformly, from a zipfian distribution (-z theta) or sequentially
+//   -r -w -d    the read / write / delete percents of the operations
+//   -u          a write is a put, a get then a put of the counter, or a hash_table_upsert
+//   -e          merges left to hash_table_maintenance with that budget, outside the latencies
+//   -m          the key mix
+//   -c          keys stored compressed, needs an invertible mix
+//   -l          the piece layout, keys makes the table a set with every value 0
+//   -a          pages from malloc or the huge page pool, dTLB misses are -1 if they can't be counted
+//   -f -M       the table lives in a file of up to -M bytes
+//   -C          bytes of the file kept in memory, cache_percent is that part of the table
+//   -W          changes logged to the file's name with .log, that many per fdatasync
+//   -s          the seed
+//
+//   ./bench -n 1000000 -o 10000000 -k zipf -r 90 -w 9 -d 1
+//   ./bench -n 20000000 -o 20000000 -r 100 -w 0 -a pool
+//   ./bench -n 20000000 -o 0 -m multiply -c
+//   for l in varint fixed-8-4 fixed-8-8 keys; do ./bench -n 5000000 -o 20000000 -r 100 -w 0 -l $l; done
+//   for u in get-put upsert; do ./bench -n 5000000 -o 20000000 -r 0 -w 100 -u $u; done
+//   for c in 64 256 1024 4096; do ./bench -n 100000000 -o 10000000 -r 100 -w 0 -f /data/t -C $((c << 20)); done
+//   for g in 1 16 256 4096; do ./bench -n 1000000 -o 4000000 -r 50 -w 40 -d 10 -f /data/t -W $g; done
+//   for e in 0 16; do ./bench -n 5000000 -o 10000000 -r 50 -w 0 -d 50 -e $e; done
+//
+// The bucket size is a compile time choice, a sweep builds a binary per geometry:
+//
+//   for b in 12 13 14 16; do
+//     cc -O2 -std=gnu11 -DVALIDATE=0 -DHASH_BUCKET_PAGE_BITS=$b -o bench-$b bench.c hash.c scan.c epoch.c sharded.c file.c pool.c debug.c -lm
+//     ./bench-$b -n 5000000 -o 20000000 -r 80 -w 15 -d 5
+//   done
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "ehash.h"
+
+#define BENCH_MAINTENANCE_INTERVAL	1024
+
+typedef enum bench_keys {
+	BENCH_KEYS_UNIFORM,
+	BENCH_KEYS_ZIPF,
+	BENCH_KEYS_SEQUENTIAL,
+} bench_keys_t;
+
+typedef enum bench_writes {
+	BENCH_WRITES_PUT,
+	BENCH_WRITES_GET_PUT,
+	BENCH_WRITES_UPSERT,
+} bench_writes_t;
+
+typedef struct bench_options {
+	uint64_t entries;
+	uint64_t ops;
+	bench_keys_t keys;
+	double zipf_theta;
+	uint32_t read_percent;
+	uint32_t write_percent;
+	uint32_t delete_percent;
+	bench_writes_t writes;
+	uint8_t mix;
+	bool compress_keys;
+	uint8_t layout;
+	bool pool;
+	const char* file;
+	uint64_t file_max_size;
+	uint64_t cache_size; // 0 leaves the file to the page cache
+	uint32_t log_group; // 0 for no log
+	uint64_t seed;
+	uint32_t maintenance_budget; // 0 merges on delete
+} bench_options_t;
+
+static const char* _bench_keys_names[] = { "uniform", "zipf", "sequential" };
+static const char* _bench_mix_names[] = { "identity", "multiply", "wyhash" };
+static const char* _bench_writes_names[] = { "put", "get-put", "upsert" };
+static const char* _bench_layout_names[] = { "varint", "fixed-8-4", "fixed-8-8", "keys" };
+static const char* _bench_allocator_names[] = { "malloc", "pool" };
+
+static volatile uint64_t _bench_sink; // keeps the reads from being optimized away
+
+static void* _bench_allocate_page(hash_ctx_t* ctx, uint32_t n) {
+	(void)ctx;
+	return aligned_alloc(HASH_BUCKET_PAGE_SIZE, (size_t)HASH_BUCKET_PAGE_SIZE * n);
+}
+
+static void _bench_release_page(hash_ctx_t* ctx, void* p, uint32_t n) {
+	(void)ctx;
+	(void)n;
+	free(p);
+}
+
+static uint64_t _bench_rand(uint64_t* state) {
+	// wyrand
+	*state += 0xa0761d6478bd642full;
+	__uint128_t m = (__uint128_t)*state * (*state ^ 0xe7037ed1a0b428dbull);
+	return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+static inline uint64_t _bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// the key of the i-th entry, sequential keys are the index itself, the others are scrambled by
+// an invertible mix so they look random but can be regenerated from the index
+static inline uint64_t _bench_key(bench_options_t* opts, uint64_t i) {
+	if (opts->keys == BENCH_KEYS_SEQUENTIAL)
+		return i;
+	uint64_t k = (i + 1) * 0xbf58476d1ce4e5b9ull;
+	k ^= k >> 31;
+	k *= 0x94d049bb133111ebull;
+	return k ^ (k >> 29);
+}
+
+// the zipfian generator from Gray et al, "Quickly Generating Billion-Record Synthetic Databases"
+typedef struct bench_zipf {
+	uint64_t n;
+	double theta, alpha, zetan, eta;
+} bench_zipf_t;
+
+static void _bench_zipf_init(bench_zipf_t* z, uint64_t n, double theta) {
+	double zeta2 = 1 + pow(0.5, theta);
+	z->n = n;
+	z->theta = theta;
+	z->zetan = 0;
+	for (uint64_t i = 1; i <= n; i++)
+		z->zetan += 1 / pow((double)i, theta);
+	z->alpha = 1 / (1 - theta);
+	z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static uint64_t _bench_zipf_next(bench_zipf_t* z, uint64_t* state) {
+	double u = (_bench_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+	double uz = u * z->zetan;
+	if (uz < 1)
+		return 0;
+	if (uz < 1 + pow(0.5, z->theta))
+		return 1;
+	uint64_t v = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+	return v < z->n ? v : z->n - 1;
+}
+
+static uint64_t _bench_pick(bench_options_t* opts, bench_zipf_t* zipf, uint64_t* state, uint64_t op) {
+	switch (opts->keys) {
+	case BENCH_KEYS_ZIPF:
+		// the popular entries are spread over the table, not clustered at the low indexes
+		return _bench_key(opts, _bench_zipf_next(zipf, state));
+	case BENCH_KEYS_SEQUENTIAL:
+		return _bench_key(opts, op % opts->entries);
+	default:
+		return _bench_key(opts, _bench_rand(state) % opts->entries);
+	}
+}
+
+// the data TLB misses of this thread, -1 if the kernel doesn't let us count them
+static int _bench_tlb_open(void) {
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static void _bench_tlb_start(int fd) {
+#ifdef __linux__
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static int64_t _bench_tlb_stop(int fd) {
+	uint64_t count;
+#ifdef __linux__
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) == sizeof(count))
+			return (int64_t)count;
+	}
+#endif
+	return -1;
+}
+
+static int _bench_compare_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// the counters of the phase are the difference from the stats taken at its start
+static void _bench_report(bench_options_t* opts, hash_ctx_t* ctx, const char* phase, uint64_t ops, uint64_t elapsed, uint64_t* latencies, hash_stats_t* before, int64_t tlb_misses) {
+	uint64_t p50 = 0, p99 = 0, p999 = 0, max = 0;
+	if (ops) {
+		qsort(latencies, ops, sizeof(uint64_t), _bench_compare_u64);
+		p50 = latencies[ops * 50 / 100];
+		p99 = latencies[ops * 99 / 100];
+		p999 = latencies[ops * 999 / 1000];
+		max = latencies[ops - 1]; // the stalls, a directory doubling shows up here
+	}
+	hash_stats_t stats;
+	hash_table_get_stats(ctx, &stats);
+	uint64_t gets = stats.gets - before->gets;
+	uint64_t entries = stats.entries;
+	printf("{\"phase\": \"%s\", \"keys\": \"%s\", \"mix\": \"%s\", \"compress_keys\": %s, \"layout\": \"%s\", \"allocator\": \"%s\", \"page_size\": %d, \"entries\": %" PRIu64 ", \"ops\": %" PRIu64
+		", \"read_percent\": %u, \"write_percent\": %u, \"delete_percent\": %u, \"writes\": \"%s\", \"maintenance_budget\": %u"
+		", \"cache_size\": %" PRIu64 ", \"cache_percent\": %.1f, \"log_group\": %u"
+		", \"ops_per_sec\": %.0f, \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64
+		", \"bytes_per_entry\": %.2f, \"fill_percent\": %.1f, \"pieces_per_get\": %.3f, \"depth\": %u"
+		", \"splits\": %" PRIu64 ", \"doublings\": %" PRIu64 ", \"merges\": %" PRIu64 ", \"dtlb_misses\": %" PRId64 "}\n",
+		phase, _bench_keys_names[opts->keys], _bench_mix_names[opts->mix], opts->compress_keys ? "true" : "false", _bench_layout_names[opts->layout], opts->file ? "file" : _bench_allocator_names[opts->pool], HASH_BUCKET_PAGE_SIZE, entries, ops,
+		opts->read_percent, opts->write_percent, opts->delete_percent, _bench_writes_names[opts->writes], opts->maintenance_budget,
+		opts->cache_size, opts->cache_size && stats.bytes_allocated ? opts->cache_size * 100.0 / stats.bytes_allocated : 0, opts->log_group,
+		elapsed ? ops * 1e9 / elapsed : 0, p50, p99, p999, max,
+		entries ? (double)stats.bytes_allocated / entries : 0,
+		stats.bytes_allocated ? stats.bytes_used * 100.0 / stats.bytes_allocated : 0,
+		gets ? (double)(stats.get_pieces - before->get_pieces) / gets : 0, stats.depth,
+		stats.splits - before->splits, stats.directory_doublings - before->directory_doublings,
+		stats.page_merges - before->page_merges, tlb_misses);
+}
+
+static void _bench_usage(const char* name) {
+	fprintf(stderr, "usage: %s [-n entries] [-o ops] [-k uniform|zipf|sequential] [-z theta]\n"
+		"          [-r read%%] [-w write%%] [-d delete%%] [-u put|get-put|upsert] [-e budget]\n"
+		"          [-m identity|multiply|wyhash] [-c] [-l varint|fixed-8-4|fixed-8-8|keys]\n"
+		"          [-a malloc|pool] [-f file] [-M max file size] [-C cache size] [-W log group]\n"
+		"          [-s seed]\n", name);
+}
+
+static int _bench_lookup(const char* value, const char** names, int count) {
+	for (int i = 0; i < count; i++)
+	{
+		if (strcmp(value, names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int main(int argc, char** argv) {
+	bench_options_t opts = {
+		.entries = 1000000,
+		.ops = 10000000,
+		.keys = BENCH_KEYS_UNIFORM,
+		.zipf_theta = 0.99,
+		.read_percent = 90,
+		.write_percent = 10,
+		.delete_percent = 0,
+		.mix = HASH_MIX_IDENTITY,
+		.file_max_size = 1ull << 40,
+		.seed = 1,
+	};
+
+	int c, v;
+	while ((c = getopt(argc, argv, "n:o:k:z:r:w:d:u:e:m:cl:a:f:M:C:W:s:h")) != -1)
+	{
+		switch (c) {
+		case 'n': opts.entries = strtoull(optarg, NULL, 0); break;
+		case 'o': opts.ops = strtoull(optarg, NULL, 0); break;
+		case 'z': opts.zipf_theta = atof(optarg); break;
+		case 'r': opts.read_percent = atoi(optarg); break;
+		case 'w': opts.write_percent = atoi(optarg); break;
+		case 'd': opts.delete_percent = atoi(optarg); break;
+		case 'e': opts.maintenance_budget = atoi(optarg); break;
+		case 'f': opts.file = optarg; break;
+		case 'M': opts.file_max_size = strtoull(optarg, NULL, 0); break;
+		case 'C': opts.cache_size = strtoull(optarg, NULL, 0); break;
+		case 'W': opts.log_group = atoi(optarg); break;
+		case 's': opts.seed = strtoull(optarg, NULL, 0); break;
+		case 'c': opts.compress_keys = true; break;
+		case 'k':
+			if ((v = _bench_lookup(optarg, _bench_keys_names, 3)) < 0) {
+				_bench_usage(argv[0]);
+				return 1;
+			}
+			opts.keys = (bench_keys_t)v;
+			break;
+		case 'm':
+			if ((v = _bench_lookup(optarg, _bench_mix_names, 3)) < 0) {
+				_bench_usage(argv[0]);
+				return 1;
+			}
+			opts.mix = (uint8_t)v;
+			break;
+		case 'u':
+			if ((v = _bench_lookup(optarg, _bench_writes_names, 3)) < 0) {
+				_bench_usage(argv[0]);
+				return 1;
+			}
+			opts.writes = (bench_writes_t)v;
+			break;
+		case 'l':
+			if ((v = _bench_lookup(optarg, _bench_layout_names, 4)) < 0) {
+				_bench_usage(argv[0]);
+				return 1;
+			}
+			opts.layout = (uint8_t)v;
+			break;
+		case 'a':
+			if ((v = _bench_lookup(optarg, _bench_allocator_names, 2)) < 0) {
+				_bench_usage(argv[0]);
+				return 1;
+			}
+			opts.pool = v == 1;
+			break;
+		default:
+			_bench_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!opts.entries || opts.read_percent + opts.write_percent + opts.delete_percent != 100) {
+		fprintf(stderr, "need at least one entry, and the read, write and delete percents must add up to 100\n");
+		return 1;
+	}
+
+	hash_ctx_t ctx = { .allocate_page = _bench_allocate_page, .release_page = _bench_release_page };
+	ctx.mix = opts.mix;
+	ctx.compress_keys = opts.compress_keys;
+	ctx.layout = opts.layout;
+	ctx.deferred_compaction = opts.maintenance_budget > 0;
+	hash_pool_t* pool = NULL;
+	if (opts.pool && !opts.file) {
+		if (!(pool = hash_pool_create())) {
+			fprintf(stderr, "Failed to create the pool\n");
+			return 1;
+		}
+		ctx.allocate_page = hash_pool_allocate_page;
+		ctx.release_page = hash_pool_release_page;
+		ctx.page_state = pool;
+	}
+	char log_path[4096];
+	snprintf(log_path, sizeof(log_path), "%s.log", opts.file ? opts.file : "");
+	if (opts.file) {
+		unlink(opts.file);
+		unlink(log_path);
+		if (opts.log_group ?
+			!hash_table_open_file_logged(&ctx, opts.file, opts.file_max_size, log_path, opts.log_group) :
+			!hash_table_open_file(&ctx, opts.file, opts.file_max_size)) {
+			perror("hash_table_open_file");
+			return 1;
+		}
+		if (opts.cache_size && !hash_table_set_file_cache(&ctx, opts.cache_size)) {
+			perror("hash_table_set_file_cache");
+			return 1;
+		}
+	}
+	else if (!hash_table_init(&ctx)) {
+		fprintf(stderr, "Failed to init\n");
+		return 1;
+	}
+
+	uint64_t* latencies = malloc((opts.entries > opts.ops ? opts.entries : opts.ops) * sizeof(uint64_t));
+	if (!latencies) {
+		fprintf(stderr, "Failed to allocate the latencies\n");
+		return 1;
+	}
+
+	uint64_t value_mask = opts.layout == HASH_LAYOUT_KEYS ? 0 : ~(uint64_t)0; // a set takes 0 alone
+	int tlb = _bench_tlb_open();
+	hash_stats_t before;
+	hash_table_get_stats(&ctx, &before);
+	_bench_tlb_start(tlb);
+	uint64_t start = _bench_now();
+	for (uint64_t i = 0; i < opts.entries; i++)
+	{
+		uint64_t op_start = _bench_now();
+		if (!hash_table_put(&ctx, _bench_key(&opts, i), i & value_mask)) {
+			fprintf(stderr, "Failed to put %" PRIu64 "\n", i);
+			return 1;
+		}
+		latencies[i] = _bench_now() - op_start;
+	}
+	uint64_t elapsed = _bench_now() - start;
+	_bench_report(&opts, &ctx, "load", opts.entries, elapsed, latencies, &before, _bench_tlb_stop(tlb));
+
+	bench_zipf_t zipf = { 0 };
+	if (opts.keys == BENCH_KEYS_ZIPF)
+		_bench_zipf_init(&zipf, opts.entries, opts.zipf_theta);
+
+	uint64_t state = opts.seed;
+	hash_table_get_stats(&ctx, &before); // the run reports its own
+
+	_bench_tlb_start(tlb);
+	start = _bench_now();
+	for (uint64_t i = 0; i < opts.ops; i++)
+	{
+		uint64_t key = _bench_pick(&opts, &zipf, &state, i);
+		uint32_t dice = (uint32_t)(_bench_rand(&state) % 100);
+		uint64_t op_start = _bench_now();
+		if (dice < opts.read_percent) {
+			uint64_t value;
+			if (hash_table_get(&ctx, key, &value))
+				_bench_sink += value;
+		}
+		else if (dice < opts.read_percent + opts.write_percent) {
+			uint64_t value = 0, one = 1;
+			switch (opts.writes) {
+			case BENCH_WRITES_GET_PUT:
+				hash_table_get(&ctx, key, &value);
+				hash_table_put(&ctx, key, (value + 1) & value_mask);
+				break;
+			case BENCH_WRITES_UPSERT:
+				hash_table_upsert(&ctx, key, hash_merge_add, &one);
+				break;
+			default:
+				hash_table_put(&ctx, key, i & value_mask);
+			}
+		}
+		else {
+			hash_table_delete(&ctx, key, NULL);
+		}
+		latencies[i] = _bench_now() - op_start;
+		if (opts.maintenance_budget && i % BENCH_MAINTENANCE_INTERVAL == BENCH_MAINTENANCE_INTERVAL - 1)
+			hash_table_maintenance(&ctx, opts.maintenance_budget);
+	}
+	elapsed = _bench_now() - start;
+	_bench_report(&opts, &ctx, "run", opts.ops, elapsed, latencies, &before, _bench_tlb_stop(tlb));
+
+	free(latencies);
+	if (opts.file) {
+		hash_table_close_file(&ctx);
+		unlink(opts.file);
+		unlink(log_path);
+	}
+	else {
+		hash_table_free(&ctx);
+	}
+	if (pool)
+		hash_pool_destroy(pool);
+	if (tlb >= 0)
+		close(tlb);
+	return 0;
+}
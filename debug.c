@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
 
 #include "ehash.h"
 
@@ -32,75 +33,27 @@ void print_bits(FILE* fd, uint64_t v, int depth)
 }
 
 void print_hash_stats(hash_ctx_t* ctx) {
-
-	printf("Depth: %i - Entries: %I64u, Buckets: %i \n", ctx->dir->depth, ctx->dir->number_of_entries, ctx->dir->number_of_buckets);
-	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++)
-		ctx->dir->buckets[i]->seen = false;
-
-	uint32_t min = 64, max = 0, total = 0, empties = 0;
-	uint64_t sum = 0;
-
-	uint32_t max_overflow_chain = 0;
-	uint32_t total_chains = 0;
-	uint32_t sum_overflow_chain = 0;
-
-	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++)
-	{
-		hash_bucket_t* b = ctx->dir->buckets[i];
-		if (b->seen)
-			continue;
-		b->seen = true;
-		for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++) {
-			if (!b->pieces[i].overflowed) {
-				continue;
-			}
-			uint32_t cur = 1;
-			for (size_t j = 1; j < NUMBER_OF_HASH_BUCKET_PIECES - 1; j++) {
-				if (!b->pieces[(i + j) % NUMBER_OF_HASH_BUCKET_PIECES].overflowed)
-					break;
-				cur++;
-			}
-			if (cur > max_overflow_chain)
-				max_overflow_chain = cur;
-			if (cur >= 20)
-				total_chains++;
-			sum_overflow_chain += cur;
-		}
-		//printf("%p - Depth: %i, Entries: %I64u, Size: %i\n", b, b->depth, b->number_of_entries, total_used);
-	}
-
-
-	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++)
-		ctx->dir->buckets[i]->seen = false;
-
-	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++)
-	{
-		hash_bucket_t* b = ctx->dir->buckets[i];
-		if (b->seen)
-			continue;
-		b->seen = true;
-		size_t total_used = 0;
-		for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++) {
-			total_used += b->pieces[i].bytes_used;
-			if (b->pieces[i].bytes_used)
-				min = min < b->pieces[i].bytes_used ? min : b->pieces[i].bytes_used;
-			else
-				empties++;
-			max = max > b->pieces[i].bytes_used ? max : b->pieces[i].bytes_used;
-			sum += b->pieces[i].bytes_used;
-			total++;
-		}
-		//printf("%p - Depth: %i, Entries: %I64u, Size: %i\n", b, b->depth, b->number_of_entries, total_used);
-	}
-	printf("Total: %i, Min: %i, Max: %iu, Sum: %llu, Empties: %i, Max Chain: %i, Sum chain: %i, Total Chains: %i, Avg: %f\n", total, min, max, sum, empties, max_overflow_chain, sum_overflow_chain, total_chains, sum / (float)total);
+	hash_stats_t stats;
+	hash_table_get_stats(ctx, &stats);
+	uint64_t misses = stats.filter_rejects + stats.filter_false_positives;
+
+	printf("Depth: %u - Entries: %" PRIu64 ", Buckets: %u\n", stats.depth, stats.entries, ctx->dir->number_of_buckets);
+	printf("Bytes used: %" PRIu64 ", allocated: %" PRIu64 " (%.1f%%), pages allocated: %" PRIu64 ", released: %" PRIu64 "\n",
+		stats.bytes_used, stats.bytes_allocated, stats.bytes_allocated ? stats.bytes_used * 100.0 / stats.bytes_allocated : 0,
+		stats.pages_allocated, stats.pages_released);
+	printf("Gets: %" PRIu64 ", pieces per get: %.3f, overflow pieces: %" PRIu64 ", filter rejects: %" PRIu64 ", false positives: %" PRIu64 " (%f)\n",
+		stats.gets, stats.gets ? (double)stats.get_pieces / stats.gets : 0, stats.get_overflow_pieces,
+		stats.filter_rejects, stats.filter_false_positives, misses ? (double)stats.filter_false_positives / misses : 0);
+	printf("Puts: %" PRIu64 ", deletes: %" PRIu64 ", splits: %" PRIu64 ", doublings: %" PRIu64 ", shrinks: %" PRIu64 ", overflow merges: %" PRIu64 ", page merges: %" PRIu64 "\n",
+		stats.puts, stats.deletes, stats.splits, stats.directory_doublings, stats.directory_shrinks, stats.overflow_merges, stats.page_merges);
 }
 
-void print_bucket(FILE* fd, hash_bucket_t* b, uint8_t idx) {
+void print_bucket(FILE* fd, hash_ctx_t* ctx, hash_bucket_t* b, uint8_t idx) {
 	size_t total_used = 0;
 	for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++) {
 		total_used += b->pieces[i].bytes_used;
 	}
-	fprintf(fd, "\tbucket_%p [label=\"Depth: %u, Entries: %llu, Size: %llu, Index: %u\\l--------\\l",
+	fprintf(fd, "\tbucket_%p [label=\"Depth: %u, Entries: %" PRIu64 ", Size: %zu, Index: %u\\l--------\\l",
 		b, b->depth, b->number_of_entries, total_used, idx);
 	for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++) {
 		hash_bucket_piece_t* p = &b->pieces[i];
@@ -109,11 +62,38 @@ void print_bucket(FILE* fd, hash_bucket_t* b, uint8_t idx) {
 		while (buf < end)
 		{
 			uint64_t k = 0, v = 0;
-			varint_decode(&buf, &k);
-			varint_decode(&buf, &v);
+			if (ctx->layout == HASH_LAYOUT_VARINT) {
+				varint_decode(&buf, &k);
+				varint_decode(&buf, &v);
+			}
+			else if (ctx->layout == HASH_LAYOUT_KEYS) {
+				varint_decode(&buf, &k);
+			}
+			else if (ctx->layout == HASH_LAYOUT_MULTIMAP) {
+				// the number of values, after the deltas or the run's ref
+				uint64_t header, size;
+				varint_decode(&buf, &k);
+				varint_decode(&buf, &header);
+				if (header & 1) {
+					memcpy(&v, buf + sizeof(hash_page_ref_t), sizeof(uint64_t));
+					buf += sizeof(hash_page_ref_t) + sizeof(uint64_t);
+				}
+				else {
+					varint_decode(&buf, &size);
+					v = header >> 1;
+					buf += size;
+				}
+			}
+			else {
+				memcpy(&k, buf, sizeof(uint64_t));
+				buf += sizeof(uint64_t);
+				uint8_t value_size = ctx->layout == HASH_LAYOUT_FIXED_8_4 ? sizeof(uint32_t) : sizeof(uint64_t);
+				memcpy(&v, buf, value_size); // little endian
+				buf += value_size;
+			}
 
 			print_bits(fd, k, b->depth);
-			fprintf(fd, " \\| %4llu = %4llu\\l", k, v);
+			fprintf(fd, " \\| %4" PRIu64 " = %4" PRIu64 "\\l", k, v);
 		}
 	}
 	fprintf(fd, "\"]\n");
@@ -121,26 +101,27 @@ void print_bucket(FILE* fd, hash_bucket_t* b, uint8_t idx) {
 
 void print_dir_graphviz_to_file(FILE* fd, hash_ctx_t* ctx) {
 	fprintf(fd, "digraph hash {\n\tnode[shape = record ]; \n");
-	fprintf(fd, "\ttable [label=\"Depth: %i, Size: %i\\lPages: %i, Entries: %I64u\\l\"]\n", ctx->dir->depth, ctx->dir->number_of_buckets, ctx->dir->directory_pages, ctx->dir->number_of_entries);
+	fprintf(fd, "\ttable [label=\"Depth: %i, Size: %u\\lPages: %u, Entries: %" PRIu64 "\\l\"]\n", ctx->dir->depth, ctx->dir->number_of_buckets, ctx->dir->directory_pages, ctx->dir->number_of_entries);
 	fprintf(fd, "\tbuckets [label=\"");
 	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++)
 	{
 		if (i != 0)
 			fprintf(fd, "|");
-		fprintf(fd, "<bucket_%Iu> %Iu - %p ", i, i, &ctx->dir->buckets[i]);
-		ctx->dir->buckets[i]->seen = false;
+		fprintf(fd, "<bucket_%zu> %zu - %p ", i, i, (void*)&hash_directory_segment(ctx, ctx->dir, i)[i & (HASH_DIRECTORY_SEGMENT_SLOTS - 1)]);
+		hash_directory_bucket(ctx, ctx->dir, i)->seen = false;
 	}
 	fprintf(fd, "\"]\n");
 	for (uint32_t i = 0; i < ctx->dir->number_of_buckets; i++)
 	{
-		if (ctx->dir->buckets[i]->seen)
+		hash_bucket_t* b = hash_directory_bucket(ctx, ctx->dir, i);
+		if (b->seen)
 			continue;
-		ctx->dir->buckets[i]->seen = true;
-		print_bucket(fd, ctx->dir->buckets[i], i);
+		b->seen = true;
+		print_bucket(fd, ctx, b, i);
 	}
 
 	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++) {
-		fprintf(fd, "\tbuckets:bucket_%Iu -> bucket_%p;\n", i, ctx->dir->buckets[i]);
+		fprintf(fd, "\tbuckets:bucket_%zu -> bucket_%p;\n", i, (void*)hash_directory_bucket(ctx, ctx->dir, i));
 	}
 	fprintf(fd, "\ttable->buckets;\n}\n");
 }
@@ -151,27 +132,21 @@ void print_dir_graphviz(hash_ctx_t* ctx) {
 
 void write_dir_graphviz(hash_ctx_t* ctx, const char* prefix) {
 	static int counter = 0;
-	uint8_t buffer[256];
-	memset(buffer, 0, sizeof buffer);
+	char buffer[256];
 	counter++;
-	sprintf_s(buffer, sizeof buffer, "%s-%i.txt", prefix, counter);
-	FILE* f = NULL;
-	errno_t err = fopen_s(&f, buffer, "w");
-	if (err)
+	snprintf(buffer, sizeof buffer, "%s-%i.txt", prefix, counter);
+	FILE* f = fopen(buffer, "w");
+	if (!f)
 	{
-		printf("Failed to open %s - %i", buffer, err);
+		printf("Failed to open %s - %i", buffer, errno);
 		return;
 	}
 	print_dir_graphviz_to_file(f, ctx);
-	if (f != 0)
-		fclose(f);
+	fclose(f);
 
-	char* copy = _strdup(buffer);
-	memset(buffer, 0, sizeof buffer);
-	sprintf_s(buffer, sizeof buffer, "C:\\Users\\ayende\\Downloads\\graphviz-2.38\\release\\bin\\dot.exe  -Tsvg %s > %s.svg", copy, copy);
-	system(buffer);
-	memset(buffer, 0, sizeof buffer);
-	sprintf_s(buffer, sizeof buffer, "%s.svg", copy);
-	system(buffer);
-	free(copy);
+	// renders it next to the text, if graphviz is on the path
+	char command[600];
+	snprintf(command, sizeof command, "dot -Tsvg %s > %s.svg", buffer, buffer);
+	if (system(command) != 0)
+		printf("Failed to render %s\n", buffer);
 }
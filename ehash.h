@@ -1,14 +1,49 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
 
+#ifndef VALIDATE
 #define VALIDATE 1
+#endif
 
-#define HASH_BUCKET_PAGE_SIZE			   8192
-#define HASH_BUCKET_PAGE_SIZE_MERGE_LIMIT  6144
-#define NUMBER_OF_HASH_BUCKET_PIECES		127
+#ifndef HASH_STATS
+#define HASH_STATS 1 // 0 compiles the counters out
+#endif
+
+// The bucket geometry is chosen at compile time, -DHASH_BUCKET_PAGE_BITS=12 builds 4 KB buckets,
+// 14 16 KB and 16 64 KB ones, everything sized by the page follows from it. Smaller buckets split
+// cheaper and waste less in a sparse table, larger ones keep the directory shallow. The number
+// of pieces being a constant, the piece of a hash is a multiply and not a division.
+#ifndef HASH_BUCKET_PAGE_BITS
+#define HASH_BUCKET_PAGE_BITS				 13
+#endif
+#define HASH_BUCKET_PAGE_SIZE				(1 << HASH_BUCKET_PAGE_BITS)
+#define HASH_BUCKET_PAGE_SIZE_MERGE_LIMIT	(HASH_BUCKET_PAGE_SIZE / 4 * 3)
+#ifndef HASH_BUCKET_FILTER_LINES
+#define HASH_BUCKET_FILTER_LINES			(HASH_BUCKET_PAGE_SIZE / 1024) // taken from the pieces, 0 turns the filter off
+#endif
+#define HASH_BUCKET_FILTER_HASHES			  3
+#define NUMBER_OF_HASH_BUCKET_PIECES		(HASH_BUCKET_PAGE_SIZE / 64 - 1 - HASH_BUCKET_FILTER_LINES)
 #define PIECE_BUCKET_BUFFER_SIZE			 63
 #define MAX_CHAIN_LENGTH					 16
+#define HASH_BATCH_PREFETCH_DISTANCE		  8
+#define HASH_EPOCH_MAX_THREADS			   1024
+#define HASH_SHARDED_MAX_BITS				 10
+#define HASH_BULK_LOAD_FILL_PERCENT			 75
+#define HASH_BULK_LOAD_SAMPLE			  65536
+#define HASH_STATS_STRIPES					 16
+#define HASH_DIRECTORY_SEGMENT_BITS			(HASH_BUCKET_PAGE_BITS - 3) // a page of slots
+#define HASH_DIRECTORY_SEGMENT_SLOTS		((uint64_t)1 << HASH_DIRECTORY_SEGMENT_BITS)
+#define HASH_DIRECTORY_MAX_DEPTH			 31 // number_of_buckets is 32 bits
+#define HASH_LOG_CHECKPOINT_SIZE			(64 << 20) // bytes of log a checkpoint empties
+#define HASH_POOL_REGION_SIZE		(2u << 20) // a huge page
+#define HASH_POOL_CACHE_PAGES				 64
+#define HASH_SCAN_MIN_BATCH					(NUMBER_OF_HASH_BUCKET_PIECES * (PIECE_BUCKET_BUFFER_SIZE / 2)) // entries a bucket can hold
+#define HASH_SET_SCAN_MIN_BATCH				(NUMBER_OF_HASH_BUCKET_PIECES * PIECE_BUCKET_BUFFER_SIZE) // a set's entries can be a byte
+#define HASH_MULTIMAP_INLINE_SIZE			 24 // bytes of a key's values kept in its piece, more go to a run
 
 typedef struct hash_bucket_piece {
 	uint8_t overflowed : 1;
@@ -24,40 +59,279 @@ typedef struct hash_bucket {
 			uint64_t number_of_entries;
 			uint8_t depth;
 			bool seen;
+			bool compaction_pending; // a delete emptied one of its pieces, see hash_table_maintenance
+			uint32_t seq; // odd while a writer modifies the bucket, readers validate against it
+			uint32_t filter_deletes; // keys deleted since the filter was built, they are still in it
+			uint32_t prefix; // the low depth bits that the hashes of all its keys share
+			uint32_t generation; // the table's when the page was written, see hash_table_snapshot
 		};
 		uint8_t _padding[64];
 	};
 	hash_bucket_piece_t pieces[NUMBER_OF_HASH_BUCKET_PIECES];
+	uint64_t filter[HASH_BUCKET_FILTER_LINES * 8]; // blocked bloom filter of the keys in the bucket
 } hash_bucket_t;
 
+static_assert(sizeof(hash_bucket_t) == HASH_BUCKET_PAGE_SIZE, "hash_bucket_t is expected to fill a page exactly");
+static_assert(HASH_BUCKET_PAGE_BITS >= 12 && HASH_BUCKET_PAGE_BITS <= 16, "buckets are 4 KB to 64 KB");
+static_assert(HASH_DIRECTORY_MAX_DEPTH <= sizeof(((hash_bucket_t*)0)->prefix) * 8, "a bucket's prefix holds the low depth bits of its hashes");
+
+// buckets are referenced by page number from ctx->base, which is NULL for pages from the heap
+// (so the page number is the address / page size) and the mapping's address for a file
+typedef uint64_t hash_page_ref_t;
+
+// how keys are turned into the hash that picks their slot and piece, the key itself is stored
+typedef enum hash_key_mix {
+	HASH_MIX_IDENTITY, // the raw key, for keys that are already random
+	HASH_MIX_MULTIPLY, // a multiply with the high half folded in, invertible
+	HASH_MIX_WYHASH, // wyhash's 128 bit multiply folded to 64 bits, the strongest, not invertible
+} hash_key_mix_t;
+
+// how the entries of a piece are written. The fixed layouts trade the space varints save on small
+// numbers for lookups that compare whole keys instead of decoding, they pay off for keys that are
+// hashes (a 64 bit varint takes 10 bytes). Entries are still packed one after the other, so the
+// piece keeps its bytes_used and everything that moves entries around works on both.
+typedef enum hash_layout {
+	HASH_LAYOUT_VARINT, // varint key and value
+	HASH_LAYOUT_FIXED_8_4, // 8 byte key and 4 byte value, 5 entries a piece, larger values are refused
+	HASH_LAYOUT_FIXED_8_8, // 8 byte key and value, 3 entries a piece
+	HASH_LAYOUT_KEYS, // varint key alone, for sets, every value is 0 and any other is refused
+	HASH_LAYOUT_MULTIMAP, // varint key and all of its values, see hash_table_add
+} hash_layout_t;
+
+// The slots are kept in segments of HASH_DIRECTORY_SEGMENT_SLOTS, the directory pages hold the
+// refs of the segments. Doubling a directory past its first segment only bumps the depth: a
+// segment that is 0 reads as the one with the top bit of its index cleared, which is what a copy
+// would have held. It gets a copy of its own once a split needs its slots to differ from those.
 typedef struct hash_directory {
 	uint64_t number_of_entries;
+	uint64_t bytes_used; // by the encoded entries
 	uint32_t number_of_buckets;
+	uint32_t number_of_bucket_pages; // distinct buckets, a bucket usually shows up in several slots
 	uint32_t directory_pages;
+	uint32_t segment_pages;
 	uint32_t version;
+	uint32_t generation; // given to the pages written now, a snapshot moves the next write to the next one
 	uint8_t depth;
-	hash_bucket_t* buckets[0];
+	uint8_t mix; // the hash_key_mix_t the table was created with
+	bool compress_keys;
+	uint8_t layout; // hash_layout_t
+	// the distinct buckets of each depth, the directory can shrink once none is as deep as it
+	uint32_t buckets_at_depth[HASH_DIRECTORY_MAX_DEPTH + 1];
+	hash_page_ref_t segments[0];
 } hash_directory_t;
 
+static_assert(HASH_DIRECTORY_SEGMENT_SLOTS * sizeof(hash_page_ref_t) == HASH_BUCKET_PAGE_SIZE, "a directory segment is a page");
+static_assert(HASH_DIRECTORY_MAX_DEPTH < sizeof(((hash_directory_t*)0)->number_of_buckets) * 8, "number_of_buckets counts the slots of the deepest directory");
+
+typedef struct hash_retired_page {
+	void* page;
+	uint32_t pages;
+	uint64_t epoch;
+} hash_retired_page_t;
+
+// a page the table no longer uses that the snapshots of the generations born .. dropped - 1 still read
+typedef struct hash_shared_page {
+	void* page;
+	uint32_t pages;
+	uint32_t born;
+	uint32_t dropped;
+} hash_shared_page_t;
+
+// the values of a multimap key that outgrew HASH_MULTIMAP_INLINE_SIZE, in pages of their own that
+// the key's entry points to. They are varints in ascending order, each the difference from the one
+// before. The entry has the count the table has, what is past it belongs to a later change.
+typedef struct hash_value_run {
+	uint64_t count;
+	uint64_t last; // the largest value, a larger one is appended
+	uint32_t bytes_used;
+	uint32_t pages;
+	uint32_t generation; // the table's when the run was written, like a bucket's
+	uint8_t data[0];
+} hash_value_run_t;
+
+typedef struct hash_stats {
+	uint64_t gets;
+	uint64_t get_pieces; // scanned by gets, get_pieces / gets is the probes per get
+	uint64_t get_overflow_pieces; // the part of get_pieces past the key's own piece
+	uint64_t filter_rejects; // lookups the bucket filter answered alone
+	uint64_t filter_false_positives; // lookups the filter let through for a missing key
+	uint64_t puts;
+	uint64_t deletes;
+	uint64_t splits;
+	uint64_t directory_doublings;
+	uint64_t directory_shrinks;
+	uint64_t overflow_merges;
+	uint64_t page_merges;
+	uint64_t pages_allocated;
+	uint64_t pages_released;
+	// the rest are read from the table, not counted
+	uint64_t entries;
+	uint64_t bytes_used;
+	uint64_t bytes_allocated;
+	uint8_t depth;
+} hash_stats_t;
+
+typedef struct hash_stats_stripe {
+	_Alignas(64) hash_stats_t stats; // a cache line of its own, the threads on other stripes don't share it
+} hash_stats_stripe_t;
+
+typedef struct hash_pool hash_pool_t;
+
+// what a change handed to log_change did, a multimap's are adds and removes of single values
+typedef enum hash_change {
+	HASH_CHANGE_PUT,
+	HASH_CHANGE_DELETE,
+	HASH_CHANGE_ADD,
+	HASH_CHANGE_REMOVE_VALUE,
+} hash_change_t;
+
 typedef struct hash_ctx {
-	void* (*allocate_page)(uint32_t n);
-	void (*release_page)(void* p);
+	// n contiguous pages, aligned to HASH_BUCKET_PAGE_SIZE
+	void* (*allocate_page)(struct hash_ctx* ctx, uint32_t n);
+	void (*release_page)(struct hash_ctx* ctx, void* p, uint32_t n);
+	void* page_state; // owned by the page allocator
+	uint8_t* base;
+	// set by a file backed table with a cache limit, every bucket reached through the directory is
+	// reported so the resident pages can be held to it, prefetch_page starts reading a bucket in
+	void (*touch_page)(struct hash_ctx* ctx, void* page);
+	void (*prefetch_page)(struct hash_ctx* ctx, void* page);
+	// set along with touch_page, called by the writer after each change and by hash_table_maintenance
+	// (now set) to drop the pages past the limit, readers never run it
+	void (*evict_pages)(struct hash_ctx* ctx, bool now);
+	// set by a file backed table with a log, called with every change once it is made
+	bool (*log_change)(struct hash_ctx* ctx, hash_change_t change, uint64_t key, uint64_t value);
 	hash_directory_t* dir;
+	// set before hash_table_init to allow hash_table_get / hash_table_get_batch from any number
+	// of threads while a single writer modifies the table, pages are then released only
+	// once no reader can observe them
+	bool concurrent;
+	bool read_only; // set by hash_table_load_mmap, the writes then fail with EROFS
+	uint8_t mix; // hash_key_mix_t, set before hash_table_init, a file backed table keeps its own
+	// set before hash_table_init to store the hash of a key without the low bits the bucket implies
+	// instead of the key, the key is recovered by inverting the mix, so HASH_MIX_WYHASH can't be used
+	bool compress_keys;
+	uint8_t layout; // hash_layout_t, set before hash_table_init, a file backed table keeps its own
+	// deletes leave merging the buckets they shrink to hash_table_maintenance, instead of doing it
+	// on the spot, can be switched at any time
+	bool deferred_compaction;
+	uint32_t compaction_count;
+	uint32_t compaction_capacity;
+	uint64_t* compaction_candidates; // the hash of a key in each bucket marked compaction_pending
+	uint32_t retired_count;
+	uint32_t retired_capacity;
+	hash_retired_page_t* retired;
+	// copy on write, the pages of an open snapshot are copied before the table writes them
+	uint32_t snapshots_count;
+	uint32_t snapshots_capacity;
+	uint32_t* snapshots; // the generations of the open snapshots, oldest first
+	uint32_t shared_count;
+	uint32_t shared_capacity;
+	hash_shared_page_t* shared;
+	uint32_t segment_generations_capacity;
+	uint32_t* segment_generations; // by segment index, a segment without one is taken as shared
+#if HASH_STATS
+	// counters since the table was opened, readers spread over the stripes by their epoch slot
+	hash_stats_stripe_t stats[HASH_STATS_STRIPES];
+#endif
 } hash_ctx_t;
 
+typedef struct hash_shard {
+	_Alignas(64) hash_ctx_t ctx;
+	uint32_t lock; // held by the shard's writer
+} hash_shard_t;
+
+// 2^shard_bits independent tables, picked by the high bits of the key. Writers to
+// different shards run in parallel, readers don't lock at all.
+typedef struct hash_sharded_ctx {
+	void* (*allocate_page)(hash_ctx_t* ctx, uint32_t n);
+	void (*release_page)(hash_ctx_t* ctx, void* p, uint32_t n);
+	void* page_state;
+	uint8_t mix; // hash_key_mix_t of the shards, also picks the shard
+	bool compress_keys;
+	uint8_t layout;
+	uint8_t shard_bits;
+	hash_shard_t* shards;
+} hash_sharded_ctx_t;
+
 typedef struct hash_old_value {
 	uint64_t value;
 	bool exists;
 } hash_old_value_t;
 
+// returns the value to store for key, value is the stored one when exists and 0 otherwise.
+// Called once per upsert, by the writer.
+typedef uint64_t (*hash_merge_fn_t)(uint64_t key, uint64_t value, bool exists, void* arg);
+
+// called with each value of key in ascending order, returning false stops
+typedef bool (*hash_value_fn_t)(uint64_t key, uint64_t value, void* arg);
+
+// a read-only view of the table at the time it was taken, see hash_table_snapshot
+typedef struct hash_snapshot {
+	hash_ctx_t* ctx;
+	hash_directory_t* dir;
+	uint32_t generation;
+} hash_snapshot_t;
+
 typedef struct hash_iteration_state {
+	hash_ctx_t* ctx;
 	hash_directory_t* dir;
 	uint32_t version;
 	uint32_t current_bucket_idx;
-	uint8_t current_piece_idx;
+	uint16_t current_piece_idx;
 	uint8_t current_piece_byte_pos;
 } hash_iteration_state_t;
 
+static inline hash_bucket_t* hash_page_at(hash_ctx_t* ctx, hash_page_ref_t ref) {
+	return (hash_bucket_t*)((uintptr_t)ctx->base + (uintptr_t)ref * HASH_BUCKET_PAGE_SIZE);
+}
+
+static inline hash_page_ref_t hash_page_ref(hash_ctx_t* ctx, void* page) {
+	return ((uintptr_t)page - (uintptr_t)ctx->base) / HASH_BUCKET_PAGE_SIZE;
+}
+
+// the segment slot i reads from, the first segment is always there so the search ends
+static inline hash_page_ref_t* hash_directory_segment(hash_ctx_t* ctx, hash_directory_t* dir, uint64_t i) {
+	uint64_t s = i >> HASH_DIRECTORY_SEGMENT_BITS;
+	hash_page_ref_t ref;
+	while (!(ref = __atomic_load_n(&dir->segments[s], __ATOMIC_ACQUIRE)))
+		s &= ~((uint64_t)1 << (63 - __builtin_clzll(s)));
+	return (hash_page_ref_t*)hash_page_at(ctx, ref);
+}
+
+static inline hash_bucket_t* hash_directory_bucket(hash_ctx_t* ctx, hash_directory_t* dir, uint64_t i) {
+	hash_page_ref_t* segment = hash_directory_segment(ctx, dir, i);
+	hash_bucket_t* b = hash_page_at(ctx, __atomic_load_n(&segment[i & (HASH_DIRECTORY_SEGMENT_SLOTS - 1)], __ATOMIC_ACQUIRE));
+	if (ctx->touch_page)
+		ctx->touch_page(ctx, b);
+	return b;
+}
+
+static inline uint64_t hash_key_mix(uint8_t mix, uint64_t key) {
+	switch (mix) {
+	case HASH_MIX_MULTIPLY: {
+		uint64_t h = key * 0x9E3779B97F4A7C15ull;
+		return h ^ (h >> 32);
+	}
+	case HASH_MIX_WYHASH: {
+		__uint128_t m = (__uint128_t)(key ^ 0xa0761d6478bd642full) * (key ^ 0xe7037ed1a0b428dbull);
+		return (uint64_t)m ^ (uint64_t)(m >> 64);
+	}
+	default:
+		return key;
+	}
+}
+
+// the key hash_key_mix turned into h, for the mixes that can be inverted
+static inline uint64_t hash_key_unmix(uint8_t mix, uint64_t h) {
+	switch (mix) {
+	case HASH_MIX_MULTIPLY:
+		h ^= h >> 32; // undoes itself on 64 bits
+		return h * 0xf1de83e19937733dull; // the inverse of 0x9E3779B97F4A7C15 modulo 2^64
+	default:
+		return h;
+	}
+}
+
 // --- debug ---
 
 void write_dir_graphviz(hash_ctx_t* ctx, const char* prefix);
@@ -66,24 +340,261 @@ void print_dir_graphviz(hash_ctx_t* ctx);
 
 void print_hash_stats(hash_ctx_t* ctx);
 
+// the chance a lookup of a missing key gets past the bucket filter, estimated from how full the filters are
+double hash_table_filter_false_positive_rate(hash_ctx_t* ctx);
+
 
 // --- API ---
 
 bool hash_table_get(hash_ctx_t* ctx, uint64_t key, uint64_t* value);
 
+// looks up n keys at once, overlapping their cache misses. Bit i of found_bitmap (n / 64 rounded
+// up words) is set if keys[i] was found, in which case values[i] holds its value. Returns the number found.
+size_t hash_table_get_batch(hash_ctx_t* ctx, const uint64_t* keys, size_t n, uint64_t* values, uint64_t* found_bitmap);
+
+// with HASH_LAYOUT_FIXED_8_4, fails with ERANGE for a value that doesn't fit in 32 bits.
+// Fails with ENOSPC when a bucket is full of keys whose hashes share their low HASH_DIRECTORY_MAX_DEPTH bits.
 bool hash_table_put(hash_ctx_t* ctx, uint64_t key, uint64_t value);
 
 bool hash_table_replace(hash_ctx_t* ctx, uint64_t key, uint64_t value, hash_old_value_t* old_value);
 
+// stores merge's value for key, finding the entry once. The entry is rewritten in place when the
+// new value encodes to the same size, and only moves (or the bucket splits) when it doesn't.
+bool hash_table_upsert(hash_ctx_t* ctx, uint64_t key, hash_merge_fn_t merge, void* arg);
+
+// merge operators for hash_table_upsert, arg points to the uint64_t operand. A missing key
+// stores the operand.
+uint64_t hash_merge_add(uint64_t key, uint64_t value, bool exists, void* arg);
+
+uint64_t hash_merge_max(uint64_t key, uint64_t value, bool exists, void* arg);
+
+uint64_t hash_merge_min(uint64_t key, uint64_t value, bool exists, void* arg);
+
+uint64_t hash_merge_or(uint64_t key, uint64_t value, bool exists, void* arg);
+
+// iteration reads each bucket at the first slot holding it, so it leaves the table untouched and works on
+// one hash_table_load_mmap loaded. It fails with EINVAL once the table is modified, hash_table_scan is the
+// one that runs alongside writers
 void hash_table_iterate_init(hash_ctx_t* ctx, hash_iteration_state_t* state);
 
 bool hash_table_iterate_next(hash_iteration_state_t* state, uint64_t* key, uint64_t* value);
 
+// fills keys / values with up to n entries, a bucket at a time, starting at *cursor (0 begins
+// a scan) and moving it on, returns the number filled. The scan is over when *cursor is 0 again.
+// The table can be modified between calls and, in concurrent mode, during them: every key that
+// is in the table for the whole scan is returned at least once, keys moved by a merge may be
+// returned more than once. Nothing is written to the table. n must be HASH_SCAN_MIN_BATCH at
+// least, HASH_SET_SCAN_MIN_BATCH for a set, so the largest bucket fits, fails with EINVAL otherwise.
+size_t hash_table_scan(hash_ctx_t* ctx, uint64_t* cursor, uint64_t* keys, uint64_t* values, size_t n);
+
 bool hash_table_delete(hash_ctx_t* ctx, uint64_t key, hash_old_value_t* old_value);
 
+// with deferred_compaction, merges the buckets deletes marked, budget of them at most, with their
+// siblings when the two fit in one and shrinks the directory when it can. Called by the writer,
+// between deletes it is just another write. Returns how many buckets are still marked.
+size_t hash_table_maintenance(hash_ctx_t* ctx, size_t budget);
+
+// fails with EINVAL when compress_keys is asked for with a mix that can't be inverted, or for an
+// unknown layout
 bool hash_table_init(hash_ctx_t* ctx);
 
+// --- sets ---
+
+// A table created with HASH_LAYOUT_KEYS stores the keys alone, a piece holds about twice the
+// entries, so a set takes half the buckets of a table with values. Everything else (splits,
+// merges, scans, snapshots, files) is the table's, a scan returns 0 for every value.
+
+// true when key is in the set now or was already
+bool hash_set_add(hash_ctx_t* ctx, uint64_t key);
+
+bool hash_set_contains(hash_ctx_t* ctx, uint64_t key);
+
+// false when key wasn't in the set, errno is 0 then
+bool hash_set_remove(hash_ctx_t* ctx, uint64_t key);
+
+// --- multimaps ---
+
+// A table created with HASH_LAYOUT_MULTIMAP maps a key to a set of values. They are kept with
+// the key, delta encoded in its piece, so one probe finds all of them. Past HASH_MULTIMAP_INLINE_SIZE
+// bytes they move to a run of pages of their own (hash_value_run_t), a hot key doesn't fill its
+// bucket or force splits. hash_table_get, scans and iteration give the number of values of a key,
+// hash_table_delete removes the key with all of them, the writes of a single value fail with ERANGE.
+
+// adds value to key's, true when it is there now or was already
+bool hash_table_add(hash_ctx_t* ctx, uint64_t key, uint64_t value);
+
+// calls fn with the values of key, returns how many it was called with, 0 for a missing key. In
+// concurrent mode fn runs inside the reader's epoch and sees the values as of a single moment.
+size_t hash_table_get_all(hash_ctx_t* ctx, uint64_t key, hash_value_fn_t fn, void* arg);
+
+// false when value wasn't one of key's, errno is 0 then. The last one takes the key with it.
+bool hash_table_remove_value(hash_ctx_t* ctx, uint64_t key, uint64_t value);
+
+// calls fn with where the page ref of each run of b's entries is, 8 unaligned bytes, for the
+// code that walks or moves the pages of a table
+void hash_bucket_for_each_run(hash_ctx_t* ctx, hash_bucket_t* b, void (*fn)(hash_ctx_t* ctx, uint8_t* ref, void* arg), void* arg);
+
+// the open snapshots must have been released
 void hash_table_free(hash_ctx_t* ctx);
 
+// fills an empty table with n entries, sizing the directory for them up front and writing each bucket
+// page once, without splits. Later duplicates of a key win.
+bool hash_table_bulk_load(hash_ctx_t* ctx, const uint64_t* keys, const uint64_t* values, size_t n);
+
+typedef bool (*hash_bulk_load_next_t)(void* state, uint64_t* key, uint64_t* value);
+
+// fills an empty table from next until it returns false, the directory is sized from expected_entries
+// and the average size of the first HASH_BULK_LOAD_SAMPLE entries
+bool hash_table_bulk_load_stream(hash_ctx_t* ctx, hash_bulk_load_next_t next, void* state, size_t expected_entries);
+
+// Snapshots: a snapshot shares every page with the table, taking one is O(1). The table copies a
+// page (bucket, directory segment or the directory) the first time it writes it after a snapshot,
+// so a snapshot costs the pages written since, which it keeps until released. Snapshots are taken
+// and released by the writer, and read from any thread, without epochs or retries. NULL with
+// ENOMEM if there is no memory to track it.
+hash_snapshot_t* hash_table_snapshot(hash_ctx_t* ctx);
+
+// releases the pages only the snapshot was still reading
+void hash_snapshot_release(hash_snapshot_t* snap);
+
+bool hash_snapshot_get(hash_snapshot_t* snap, uint64_t key, uint64_t* value);
+
+// hash_table_scan of the snapshot, every key in it is returned exactly once
+size_t hash_snapshot_scan(hash_snapshot_t* snap, uint64_t* cursor, uint64_t* keys, uint64_t* values, size_t n);
+
+// releases the pages concurrent mode is holding on to for readers, only valid when there are none
+void hash_table_release_retired(hash_ctx_t* ctx);
+
+// sums the counters, cheap enough to call from a monitoring thread while the table is in use.
+// In concurrent mode the gauges are read inside an epoch, otherwise the caller must keep the
+// writer out. With HASH_STATS 0 only the gauges are filled in.
+void hash_table_get_stats(hash_ctx_t* ctx, hash_stats_t* stats);
+
+// --- file backed tables ---
+
+// opens the table stored in path, creating it if the file is empty. The file is mapped at an address
+// reserved for max_size bytes and provides the pages, replacing ctx's allocate_page / release_page.
+// Fails with EINVAL for a file that isn't a table of this geometry or wasn't closed properly.
+bool hash_table_open_file(hash_ctx_t* ctx, const char* path, uint64_t max_size);
+
+// flushes the pages and records where the directory is, the table stays open
+bool hash_table_sync_file(hash_ctx_t* ctx);
+
+// holds the bucket pages of the file that are in memory to about cache_size bytes, for tables
+// larger than RAM. The coldest pages by CLOCK are written back and dropped, the next access reads
+// them again, so pointers into the mapping stay valid. hash_table_get_batch starts reading all
+// the buckets the batch misses at once. 0 lifts the limit. Safe with concurrent readers, they
+// only count the pages they touch, the writer's changes (every HASH_FILE_EVICT_BATCH of them)
+// and hash_table_maintenance write back and drop them.
+bool hash_table_set_file_cache(hash_ctx_t* ctx, uint64_t cache_size);
+
+// does the merges hash_table_maintenance has pending, flushes, marks the file clean and unmaps it,
+// the open snapshots must have been released. To discard the contents, hash_table_free first.
+// With a log, ends with a checkpoint.
+bool hash_table_close_file(hash_ctx_t* ctx);
+
+// hash_table_open_file with a write-ahead log in log_path, for puts and deletes that survive a
+// crash without a sync each. Changes are logged group_size at a time, with one fdatasync a
+// group, and the pages of the last checkpoint aren't written over until the next one is on
+// disk. A file that wasn't closed is opened at that checkpoint and the log is replayed onto it,
+// so what is lost is the changes since the last full group or hash_table_commit. A put or delete
+// that fails because the log couldn't be written still made its change, it goes with the next group.
+bool hash_table_open_file_logged(hash_ctx_t* ctx, const char* path, uint64_t max_size, const char* log_path, uint32_t group_size);
+
+// writes the changes logged so far as a group, they are durable once it returns
+bool hash_table_commit(hash_ctx_t* ctx);
+
+// makes the table as it is the one a crash goes back to and empties the log, also done whenever
+// the log grows past HASH_LOG_CHECKPOINT_SIZE. Does the merges hash_table_maintenance has pending,
+// the log has nothing to replay them from.
+bool hash_table_checkpoint(hash_ctx_t* ctx);
+
+// writes the table to fd as a file hash_table_open_file and hash_table_load_mmap take, in one
+// sequential pass of writev calls, so fd can be a pipe or a socket. Each bucket is written once,
+// with the page numbers of the directory already those of the output, nothing is fixed up when
+// it is loaded. The caller must keep the writer out, in concurrent mode too.
+bool hash_table_save(hash_ctx_t* ctx, int fd);
+
+// maps a saved or closed table read only, for lookups, hash_table_get_batch, scans and snapshots
+// without reading or rebuilding anything. Processes that load the same file share its pages in
+// the page cache. The writes (puts, deletes, upserts, adds, bulk loads, maintenance, a file cache)
+// fail with EROFS, hash_table_close_file unmaps it.
+bool hash_table_load_mmap(hash_ctx_t* ctx, const char* path);
+
+// --- pooled pages ---
+
+// a page allocator for tables in memory, set ctx->allocate_page / release_page to the functions
+// below and ctx->page_state to the pool. Safe to share between the shards of a sharded table.
+hash_pool_t* hash_pool_create(void);
+
+// unmaps every page, the tables using the pool must have been freed
+void hash_pool_destroy(hash_pool_t* pool);
+
+void* hash_pool_allocate_page(hash_ctx_t* ctx, uint32_t n);
+
+void hash_pool_release_page(hash_ctx_t* ctx, void* p, uint32_t n);
+
+// --- sharded API ---
+
+bool hash_sharded_init(hash_sharded_ctx_t* ctx, uint8_t shard_bits);
+
+void hash_sharded_free(hash_sharded_ctx_t* ctx);
+
+bool hash_sharded_get(hash_sharded_ctx_t* ctx, uint64_t key, uint64_t* value);
+
+bool hash_sharded_put(hash_sharded_ctx_t* ctx, uint64_t key, uint64_t value);
+
+bool hash_sharded_delete(hash_sharded_ctx_t* ctx, uint64_t key, hash_old_value_t* old_value);
+
+// merge runs under the shard's lock
+bool hash_sharded_upsert(hash_sharded_ctx_t* ctx, uint64_t key, hash_merge_fn_t merge, void* arg);
+
+// groups the keys by shard, so each shard's lock is taken once per batch, returns the number stored
+size_t hash_sharded_put_batch(hash_sharded_ctx_t* ctx, const uint64_t* keys, const uint64_t* values, size_t n);
+
+// same contract as hash_table_get_batch
+size_t hash_sharded_get_batch(hash_sharded_ctx_t* ctx, const uint64_t* keys, size_t n, uint64_t* values, uint64_t* found_bitmap);
+
+// the stats of all the shards added up, depth is the deepest shard's
+void hash_sharded_get_stats(hash_sharded_ctx_t* ctx, hash_stats_t* stats);
+
+// --- epoch reclamation ---
+
+// readers claim a slot on first use, a thread that is going away should give it back
+void hash_epoch_thread_exit(void);
+
+int32_t hash_epoch_thread_slot(void);
+
+bool hash_epoch_enter(void);
+
+void hash_epoch_exit(void);
+
+// bumps the global epoch, returning the epoch the unlinked page was retired at
+uint64_t hash_epoch_retire(void);
+
+// the oldest epoch an active reader is in, pages retired before it can be released
+uint64_t hash_epoch_min_active(void);
+
 // --- utils --- 
 void varint_decode(uint8_t** buf, uint64_t* val);
+
+void varint_encode(uint64_t val, uint8_t** buf);
+
+typedef enum hash_piece_scan {
+	HASH_PIECE_SCAN_AUTO,
+	HASH_PIECE_SCAN_SCALAR,
+	HASH_PIECE_SCAN_SSE42,
+	HASH_PIECE_SCAN_AVX2,
+} hash_piece_scan_t;
+
+// picks the piece scanning kernel, AUTO selects the best one the CPU supports, returns the one in use
+hash_piece_scan_t hash_piece_scan_select(hash_piece_scan_t kind);
+
+// find the entry whose varint encoded key is equal to key, offset is the entry position in p->data
+bool hash_piece_find(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset);
+
+// same for the keys of a set, with no value after each
+bool hash_piece_find_keys(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset);
+
+// same for the fixed layouts, key is the 8 bytes stored for it and entries are entry_size apart
+bool hash_piece_find_fixed(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t entry_size, uint8_t* offset);
@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ehash.h"
+
+// Epoch based reclamation for pages that concurrent readers may still be looking at.
+// A reader publishes the global epoch in its slot for the duration of an operation, the
+// writer unlinks a page and retires it at the current epoch, bumping the epoch as it does
+// so. The page can be released once every active reader has published a later epoch,
+// since such a reader started after the page was unlinked and cannot reach it.
+
+#define HASH_EPOCH_INACTIVE UINT64_MAX
+
+typedef struct hash_epoch_slot {
+	_Alignas(64) uint64_t epoch;
+	uint32_t claimed;
+} hash_epoch_slot_t;
+
+static hash_epoch_slot_t _slots[HASH_EPOCH_MAX_THREADS];
+static uint32_t _slots_in_use; // high water mark, no need to scan past it
+static uint64_t _global_epoch = 1;
+
+static _Thread_local int32_t _thread_slot = -1;
+static _Thread_local uint32_t _thread_nesting;
+
+int32_t hash_epoch_thread_slot(void) {
+	if (_thread_slot >= 0)
+		return _thread_slot;
+
+	for (uint32_t i = 0; i < HASH_EPOCH_MAX_THREADS; i++)
+	{
+		uint32_t expected = 0;
+		if (__atomic_load_n(&_slots[i].claimed, __ATOMIC_RELAXED) ||
+			!__atomic_compare_exchange_n(&_slots[i].claimed, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue;
+
+		__atomic_store_n(&_slots[i].epoch, HASH_EPOCH_INACTIVE, __ATOMIC_RELAXED);
+		uint32_t in_use = __atomic_load_n(&_slots_in_use, __ATOMIC_RELAXED);
+		while (in_use < i + 1 &&
+			!__atomic_compare_exchange_n(&_slots_in_use, &in_use, i + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+		_thread_slot = (int32_t)i;
+		return _thread_slot;
+	}
+	return -1;
+}
+
+void hash_epoch_thread_exit(void) {
+	if (_thread_slot < 0)
+		return;
+	__atomic_store_n(&_slots[_thread_slot].epoch, HASH_EPOCH_INACTIVE, __ATOMIC_RELEASE);
+	__atomic_store_n(&_slots[_thread_slot].claimed, 0, __ATOMIC_RELEASE);
+	_thread_slot = -1;
+	_thread_nesting = 0;
+}
+
+bool hash_epoch_enter(void) {
+	if (_thread_nesting++)
+		return true;
+
+	int32_t slot = hash_epoch_thread_slot();
+	if (slot < 0) {
+		_thread_nesting = 0;
+		return false; // more threads than slots
+	}
+
+	uint64_t epoch = __atomic_load_n(&_global_epoch, __ATOMIC_SEQ_CST);
+	while (true) {
+		__atomic_store_n(&_slots[slot].epoch, epoch, __ATOMIC_SEQ_CST);
+		// if the epoch moved while we published ours, a writer may have already
+		// scanned the slots without seeing us, so we publish the new one instead
+		uint64_t current = __atomic_load_n(&_global_epoch, __ATOMIC_SEQ_CST);
+		if (current == epoch)
+			return true;
+		epoch = current;
+	}
+}
+
+void hash_epoch_exit(void) {
+	if (--_thread_nesting)
+		return;
+	__atomic_store_n(&_slots[_thread_slot].epoch, HASH_EPOCH_INACTIVE, __ATOMIC_RELEASE);
+}
+
+uint64_t hash_epoch_retire(void) {
+	return __atomic_fetch_add(&_global_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+uint64_t hash_epoch_min_active(void) {
+	uint64_t min = HASH_EPOCH_INACTIVE;
+	uint32_t in_use = __atomic_load_n(&_slots_in_use, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < in_use; i++)
+	{
+		uint64_t epoch = __atomic_load_n(&_slots[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch < min)
+			min = epoch;
+	}
+	return min;
+}
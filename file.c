@@ -0,0 +1,951 @@
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "ehash.h"
+
+// A file backed table: page 0 is the header, every other page is a bucket, a directory page
+// or free. The whole reserved size is mapped up front, so the mapping never moves as the
+// file grows, and since the directory holds page numbers relative to the mapping, opening
+// the file again is just mapping it and pointing ctx->dir at the directory page.
+//
+// With a log, a checkpoint is a snapshot of the table that is kept open until the next one:
+// the table copies the pages of a snapshot before writing them, so once the checkpoint's pages
+// are synced and the header names its directory, they stay on disk as they are. Recovery
+// opens the table at that directory, takes every page it doesn't reach as free, and replays
+// the log groups written after it.
+
+#define HASH_FILE_MAGIC				0x4C49464853414845ull // "EHASHFIL"
+#define HASH_FILE_VERSION			8
+#define HASH_FILE_MIN_GROWTH_PAGES	256
+#define HASH_FILE_EVICT_BATCH		64 // pages dropped below the cache limit at once, so eviction isn't per access
+
+#define HASH_LOG_CHANGE_MAX_SIZE	21 // the hash_change_t and two varints
+#define HASH_FILE_SAVE_BATCH		64 // pages hash_table_save hands to a writev
+
+// the CLOCK state of a page
+#define HASH_FILE_PAGE_RESIDENT		1
+#define HASH_FILE_PAGE_REFERENCED	2
+
+typedef struct hash_file_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t pieces_per_bucket;
+	uint32_t clean; // cleared while the file is open, a crash leaves it that way
+	uint64_t number_of_pages; // the size of the file
+	uint64_t next_page; // pages from here on were never handed out
+	uint64_t free_list; // released pages, linked through their first 8 bytes, 0 ends the list
+	uint64_t dir_page; // 0 when there is no table
+	// the table a crash goes back to, 0 when the file isn't logged
+	uint64_t checkpoint_dir_page;
+	uint64_t checkpoint_next_page;
+	uint32_t checkpoint_version; // dir->version, the groups logged after it have later ones
+} hash_file_header_t;
+
+// a group of changes in the log, written with a single write and synced as one
+typedef struct hash_log_group {
+	uint32_t size; // of the changes that follow
+	uint32_t version; // dir->version after the last of them
+	uint64_t checksum; // a group torn by a crash fails it, and ends the log
+} hash_log_group_t;
+
+typedef struct hash_file {
+	int fd;
+	uint8_t* base;
+	uint64_t reserved_pages;
+	hash_file_header_t* header;
+	// with a cache limit, the pages touched since they were last dropped, by page number
+	uint8_t* cache;
+	uint64_t cache_pages;
+	uint64_t resident_pages;
+	uint64_t clock_hand;
+	uint32_t changes; // since the writer last ran the clock
+	// the write-ahead log, the changes of the group being filled follow its header in the buffer
+	int log_fd;
+	uint8_t* log_buffer;
+	uint32_t log_capacity;
+	uint32_t log_size;
+	uint32_t log_count;
+	uint32_t log_group_size;
+	uint64_t log_file_size;
+	// the last checkpoint, and before it those the header may still name, when syncing it failed
+	uint32_t checkpoints_count;
+	uint32_t checkpoints_capacity;
+	hash_snapshot_t** checkpoints;
+} hash_file_t;
+
+static_assert(sizeof(hash_file_header_t) <= HASH_BUCKET_PAGE_SIZE, "the file header must fit in a page");
+
+static bool _hash_file_grow(hash_file_t* f, uint64_t pages) {
+	uint64_t size = f->header->number_of_pages;
+	uint64_t growth = size / 4 > HASH_FILE_MIN_GROWTH_PAGES ? size / 4 : HASH_FILE_MIN_GROWTH_PAGES;
+	uint64_t new_size = size + growth > pages ? size + growth : pages;
+	if (new_size > f->reserved_pages)
+		new_size = f->reserved_pages;
+	if (new_size < pages) {
+		errno = ENOMEM;
+		return false;
+	}
+	if (ftruncate(f->fd, (off_t)(new_size * HASH_BUCKET_PAGE_SIZE)))
+		return false;
+	f->header->number_of_pages = new_size;
+	return true;
+}
+
+// A cached file doesn't copy pages into a pool of its own, the page cache behind the mapping is
+// the pool. The accesses are counted instead, and once more pages were touched than the limit
+// allows, CLOCK picks pages to write back and drop from both the mapping and the page cache. A
+// dropped page is read back by the next access, so no page is pinned. Readers only mark the pages
+// they touch, the writer pays for the write back: it runs the clock every HASH_FILE_EVICT_BATCH
+// changes and in hash_table_maintenance, a table that is only read holds more until then.
+// Directory pages aren't reached through the directory, they are never counted and stay in memory.
+
+static bool _hash_file_drop_pages(hash_file_t* f, uint64_t first, uint64_t n) {
+	uint8_t* p = f->base + first * HASH_BUCKET_PAGE_SIZE;
+	size_t size = n * HASH_BUCKET_PAGE_SIZE;
+	// written back first, the page cache doesn't let go of dirty pages
+	if (msync(p, size, MS_SYNC))
+		return false; // still in memory, which is only a cost
+	madvise(p, size, MADV_DONTNEED);
+	posix_fadvise(f->fd, (off_t)(first * HASH_BUCKET_PAGE_SIZE), (off_t)size, POSIX_FADV_DONTNEED);
+	return true;
+}
+
+// the writer's, the readers only move the bits the clock reads
+static void _hash_file_evict(hash_file_t* f) {
+	uint64_t target = f->cache_pages > HASH_FILE_EVICT_BATCH ? f->cache_pages - HASH_FILE_EVICT_BATCH : 0;
+	uint64_t end = __atomic_load_n(&f->header->next_page, __ATOMIC_RELAXED);
+	uint64_t run = 0, run_length = 0;
+
+	// the first turn clears the reference bits, the second can't miss a victim
+	for (uint64_t i = 0; i < 2 * end && __atomic_load_n(&f->resident_pages, __ATOMIC_RELAXED) > target; i++)
+	{
+		if (f->clock_hand < 1 || f->clock_hand >= end)
+			f->clock_hand = 1; // the header isn't a bucket
+		uint64_t p = f->clock_hand++;
+		uint8_t state = __atomic_load_n(&f->cache[p], __ATOMIC_RELAXED);
+		if (state & HASH_FILE_PAGE_REFERENCED) {
+			__atomic_and_fetch(&f->cache[p], (uint8_t)~HASH_FILE_PAGE_REFERENCED, __ATOMIC_RELAXED);
+			continue;
+		}
+		// a reader that touches the page meanwhile keeps it
+		if (!(state & HASH_FILE_PAGE_RESIDENT) ||
+			!__atomic_compare_exchange_n(&f->cache[p], &state, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		__atomic_sub_fetch(&f->resident_pages, 1, __ATOMIC_RELAXED);
+		// neighbouring pages go in one call
+		if (run_length && run + run_length == p) {
+			run_length++;
+			continue;
+		}
+		if (run_length)
+			_hash_file_drop_pages(f, run, run_length);
+		run = p;
+		run_length = 1;
+	}
+	if (run_length)
+		_hash_file_drop_pages(f, run, run_length);
+}
+
+static void _hash_file_mark_page(hash_file_t* f, void* page) {
+	uint64_t p = ((uint8_t*)page - f->base) / HASH_BUCKET_PAGE_SIZE;
+	uint8_t state = __atomic_load_n(&f->cache[p], __ATOMIC_RELAXED);
+	if (state == (HASH_FILE_PAGE_RESIDENT | HASH_FILE_PAGE_REFERENCED))
+		return; // the common case, no write to share the line with other readers
+	state = __atomic_fetch_or(&f->cache[p], HASH_FILE_PAGE_RESIDENT | HASH_FILE_PAGE_REFERENCED, __ATOMIC_RELAXED);
+	if (!(state & HASH_FILE_PAGE_RESIDENT))
+		__atomic_add_fetch(&f->resident_pages, 1, __ATOMIC_RELAXED);
+}
+
+static void _hash_file_touch_page(hash_ctx_t* ctx, void* page) {
+	_hash_file_mark_page(ctx->page_state, page);
+}
+
+// a change runs the clock once every HASH_FILE_EVICT_BATCH of them, busy readers would have it
+// run on every one
+static void _hash_file_evict_pages(hash_ctx_t* ctx, bool now) {
+	hash_file_t* f = ctx->page_state;
+	if (!now && ++f->changes < HASH_FILE_EVICT_BATCH)
+		return;
+	f->changes = 0;
+	if (__atomic_load_n(&f->resident_pages, __ATOMIC_RELAXED) > f->cache_pages)
+		_hash_file_evict(f);
+}
+
+static void _hash_file_prefetch_page(hash_ctx_t* ctx, void* page) {
+	hash_file_t* f = ctx->page_state;
+	uint64_t p = ((uint8_t*)page - f->base) / HASH_BUCKET_PAGE_SIZE;
+	// starts the read and returns, the access that follows waits for it
+	if (!(__atomic_load_n(&f->cache[p], __ATOMIC_RELAXED) & HASH_FILE_PAGE_RESIDENT))
+		madvise(page, HASH_BUCKET_PAGE_SIZE, MADV_WILLNEED);
+	_hash_file_mark_page(f, page);
+}
+
+static void* _hash_file_allocate_page(hash_ctx_t* ctx, uint32_t n) {
+	hash_file_t* f = ctx->page_state;
+	hash_file_header_t* h = f->header;
+
+	uint8_t* p;
+	if (n == 1 && h->free_list) {
+		p = f->base + h->free_list * HASH_BUCKET_PAGE_SIZE;
+		memcpy(&h->free_list, p, sizeof(uint64_t));
+	}
+	else {
+		// runs of pages (the directory) are always taken from the end of the file
+		if (h->next_page + n > h->number_of_pages && !_hash_file_grow(f, h->next_page + n))
+			return NULL;
+		p = f->base + h->next_page * HASH_BUCKET_PAGE_SIZE;
+		__atomic_store_n(&h->next_page, h->next_page + n, __ATOMIC_RELAXED); // the clock of a reader reads it
+	}
+	// the caller is about to write it, a new bucket counts against the cache like any other
+	if (f->cache && n == 1)
+		_hash_file_mark_page(f, p);
+	return p;
+}
+
+static void _hash_file_release_page(hash_ctx_t* ctx, void* p, uint32_t n) {
+	hash_file_t* f = ctx->page_state;
+	if (!p)
+		return;
+	// a released run is broken into single pages, they are reused as buckets
+	for (uint32_t i = 0; i < n; i++)
+	{
+		uint8_t* page = (uint8_t*)p + (size_t)i * HASH_BUCKET_PAGE_SIZE;
+		memcpy(page, &f->header->free_list, sizeof(uint64_t));
+		f->header->free_list = (page - f->base) / HASH_BUCKET_PAGE_SIZE;
+	}
+}
+
+static void _hash_file_close(hash_file_t* f) {
+	if (f->base != MAP_FAILED)
+		munmap(f->base, f->reserved_pages * HASH_BUCKET_PAGE_SIZE);
+	if (f->fd >= 0)
+		close(f->fd);
+	if (f->log_fd >= 0)
+		close(f->log_fd);
+	free(f->log_buffer);
+	free(f->checkpoints);
+	free(f->cache);
+	free(f);
+}
+
+static void _hash_file_mark_run(hash_ctx_t* ctx, uint8_t* ref, void* arg) {
+	hash_page_ref_t r;
+	memcpy(&r, ref, sizeof(hash_page_ref_t));
+	memset((uint8_t*)arg + r, 1, ((hash_value_run_t*)hash_page_at(ctx, r))->pages);
+}
+
+// marks the pages the table at ctx->dir reaches, everything else below next_page is free
+static bool _hash_file_rebuild_free_list(hash_ctx_t* ctx) {
+	hash_file_t* f = ctx->page_state;
+	hash_directory_t* dir = ctx->dir;
+	uint64_t pages = f->header->next_page;
+	uint8_t* used = calloc(pages, 1);
+	if (!used)
+		return false;
+
+	used[0] = 1;
+	memset(used + hash_page_ref(ctx, dir), 1, dir->directory_pages);
+	size_t capacity = (((size_t)dir->directory_pages * HASH_BUCKET_PAGE_SIZE) - sizeof(hash_directory_t)) / sizeof(hash_page_ref_t);
+	for (size_t s = 0; s < capacity; s++)
+	{
+		if (dir->segments[s])
+			used[dir->segments[s]] = 1;
+	}
+	for (size_t i = 0; i < dir->number_of_buckets; i++)
+	{
+		hash_bucket_t* b = hash_directory_bucket(ctx, dir, i);
+		used[hash_page_ref(ctx, b)] = 1;
+		hash_bucket_for_each_run(ctx, b, _hash_file_mark_run, used);
+	}
+
+	f->header->free_list = 0;
+	for (uint64_t p = pages; p-- > 1;)
+	{
+		if (!used[p])
+			_hash_file_release_page(ctx, f->base + p * HASH_BUCKET_PAGE_SIZE, 1);
+	}
+	free(used);
+	return true;
+}
+
+// frees what the table kept in memory and unmaps the file, as it is
+static void _hash_file_drop_table(hash_ctx_t* ctx) {
+	hash_file_t* f = ctx->page_state;
+	free(ctx->retired);
+	free(ctx->snapshots);
+	free(ctx->shared);
+	free(ctx->segment_generations);
+	free(ctx->compaction_candidates);
+	ctx->retired = NULL;
+	ctx->snapshots = NULL;
+	ctx->shared = NULL;
+	ctx->segment_generations = NULL;
+	ctx->compaction_candidates = NULL;
+	ctx->retired_count = ctx->retired_capacity = 0;
+	ctx->snapshots_count = ctx->snapshots_capacity = 0;
+	ctx->shared_count = ctx->shared_capacity = 0;
+	ctx->segment_generations_capacity = 0;
+	ctx->compaction_count = ctx->compaction_capacity = 0;
+	for (uint32_t i = 0; i < f->checkpoints_count; i++)
+		free(f->checkpoints[i]);
+	_hash_file_close(f);
+	ctx->page_state = NULL;
+	ctx->base = NULL;
+	ctx->touch_page = NULL;
+	ctx->prefetch_page = NULL;
+	ctx->evict_pages = NULL;
+	ctx->log_change = NULL;
+	ctx->dir = NULL;
+}
+
+static hash_file_t* _hash_file_new(uint64_t reserved_pages) {
+	hash_file_t* f = malloc(sizeof(hash_file_t));
+	if (!f)
+		return NULL;
+	f->fd = -1;
+	f->base = MAP_FAILED;
+	f->reserved_pages = reserved_pages;
+	f->cache = NULL;
+	f->cache_pages = f->resident_pages = f->clock_hand = 0;
+	f->changes = 0;
+	f->log_fd = -1;
+	f->log_buffer = NULL;
+	f->log_capacity = f->log_size = f->log_count = f->log_group_size = 0;
+	f->log_file_size = 0;
+	f->checkpoints = NULL;
+	f->checkpoints_count = f->checkpoints_capacity = 0;
+	return f;
+}
+
+// points ctx at the table whose directory is at dir_page, with nothing of an earlier session
+static void _hash_file_attach_table(hash_ctx_t* ctx, uint64_t dir_page) {
+	ctx->retired = NULL;
+	ctx->retired_count = ctx->retired_capacity = 0;
+	ctx->snapshots = NULL;
+	ctx->snapshots_count = ctx->snapshots_capacity = 0;
+	ctx->shared = NULL;
+	ctx->shared_count = ctx->shared_capacity = 0;
+	// the segments of an older session are taken as shared, the first snapshot copies them anyway
+	ctx->segment_generations = NULL;
+	ctx->segment_generations_capacity = 0;
+	// closing and checkpoints do the merges, no bucket is marked
+	ctx->compaction_candidates = NULL;
+	ctx->compaction_count = ctx->compaction_capacity = 0;
+#if HASH_STATS
+	memset(ctx->stats, 0, sizeof(ctx->stats));
+#endif
+	ctx->dir = (hash_directory_t*)hash_page_at(ctx, dir_page);
+	ctx->mix = ctx->dir->mix; // the keys were placed with it, whatever the caller asked for
+	ctx->compress_keys = ctx->dir->compress_keys;
+	ctx->layout = ctx->dir->layout;
+}
+
+// with logged, a file that wasn't closed properly is opened at its checkpoint, *recovering says so
+static bool _hash_file_open(hash_ctx_t* ctx, const char* path, uint64_t max_size, bool logged, bool* recovering) {
+	hash_file_t* f = _hash_file_new(max_size / HASH_BUCKET_PAGE_SIZE);
+	if (!f)
+		return false;
+	f->fd = open(path, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	if (f->fd < 0 || fstat(f->fd, &st))
+		goto fail;
+
+	f->base = mmap(NULL, f->reserved_pages * HASH_BUCKET_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, f->fd, 0);
+	if (f->base == MAP_FAILED)
+		goto fail;
+	f->header = (hash_file_header_t*)f->base;
+
+	if (st.st_size == 0) {
+		if (ftruncate(f->fd, HASH_FILE_MIN_GROWTH_PAGES * HASH_BUCKET_PAGE_SIZE))
+			goto fail;
+		memset(f->header, 0, sizeof(hash_file_header_t));
+		f->header->magic = HASH_FILE_MAGIC;
+		f->header->version = HASH_FILE_VERSION;
+		f->header->page_size = HASH_BUCKET_PAGE_SIZE;
+		f->header->pieces_per_bucket = NUMBER_OF_HASH_BUCKET_PIECES;
+		f->header->number_of_pages = HASH_FILE_MIN_GROWTH_PAGES;
+		f->header->next_page = 1;
+		f->header->clean = 1;
+	}
+	else if (f->header->magic != HASH_FILE_MAGIC ||
+		f->header->version != HASH_FILE_VERSION ||
+		f->header->page_size != HASH_BUCKET_PAGE_SIZE ||
+		f->header->pieces_per_bucket != NUMBER_OF_HASH_BUCKET_PIECES ||
+		((uint64_t)st.st_size < f->header->number_of_pages * HASH_BUCKET_PAGE_SIZE && f->header->clean) ||
+		f->header->number_of_pages > f->reserved_pages ||
+		(!f->header->clean && !(logged && f->header->checkpoint_dir_page))) {
+		// not ours, from a different build, truncated or not closed properly
+		errno = EINVAL;
+		goto fail;
+	}
+
+	ctx->allocate_page = _hash_file_allocate_page;
+	ctx->release_page = _hash_file_release_page;
+	ctx->page_state = f;
+	ctx->base = f->base;
+	ctx->touch_page = NULL;
+	ctx->prefetch_page = NULL;
+	ctx->evict_pages = NULL;
+	ctx->log_change = NULL;
+
+	*recovering = !f->header->clean;
+	if (*recovering) {
+		// whatever was written since the checkpoint is garbage, the log has it. The size may have
+		// made it to disk without the growth of the file
+		if ((uint64_t)st.st_size < f->header->number_of_pages * HASH_BUCKET_PAGE_SIZE &&
+			ftruncate(f->fd, (off_t)(f->header->number_of_pages * HASH_BUCKET_PAGE_SIZE)))
+			goto fail;
+		f->header->dir_page = f->header->checkpoint_dir_page;
+		f->header->next_page = f->header->checkpoint_next_page;
+	}
+	else {
+		// a table closed properly is its own checkpoint, until the logged open takes one
+		f->header->checkpoint_dir_page = logged ? f->header->dir_page : 0;
+		f->header->checkpoint_next_page = f->header->next_page;
+		f->header->checkpoint_version = f->header->dir_page ? ((hash_directory_t*)hash_page_at(ctx, f->header->dir_page))->version : 0;
+	}
+	f->header->clean = 0;
+	if (msync(f->base, HASH_BUCKET_PAGE_SIZE, MS_SYNC))
+		goto fail;
+
+	if (!f->header->dir_page) {
+		if (!hash_table_init(ctx))
+			goto fail;
+		f->header->dir_page = hash_page_ref(ctx, ctx->dir);
+		return true;
+	}
+
+	_hash_file_attach_table(ctx, f->header->dir_page);
+	if (*recovering && !_hash_file_rebuild_free_list(ctx)) {
+		_hash_file_drop_table(ctx);
+		return false;
+	}
+	return true;
+
+fail:
+	ctx->page_state = NULL;
+	ctx->base = NULL;
+	ctx->touch_page = NULL;
+	ctx->prefetch_page = NULL;
+	ctx->evict_pages = NULL;
+	ctx->log_change = NULL;
+	_hash_file_close(f);
+	return false;
+}
+
+bool hash_table_open_file(hash_ctx_t* ctx, const char* path, uint64_t max_size) {
+	bool recovering;
+	return _hash_file_open(ctx, path, max_size, false, &recovering);
+}
+
+bool hash_table_sync_file(hash_ctx_t* ctx) {
+	hash_file_t* f = ctx->page_state;
+	if (ctx->read_only) {
+		errno = EROFS;
+		return false;
+	}
+	// the directory may have moved since we opened
+	f->header->dir_page = ctx->dir ? hash_page_ref(ctx, ctx->dir) : 0;
+	return msync(f->base, f->header->number_of_pages * HASH_BUCKET_PAGE_SIZE, MS_SYNC) == 0;
+}
+
+bool hash_table_set_file_cache(hash_ctx_t* ctx, uint64_t cache_size) {
+	hash_file_t* f = ctx->page_state;
+	// the writer runs the clock, and the clean pages of a loaded table are the kernel's to drop
+	if (ctx->read_only) {
+		errno = EROFS;
+		return false;
+	}
+	if (!cache_size) {
+		ctx->touch_page = NULL;
+		ctx->prefetch_page = NULL;
+		ctx->evict_pages = NULL;
+		return true;
+	}
+	if (!f->cache && !(f->cache = calloc(f->reserved_pages, 1)))
+		return false;
+	f->cache_pages = cache_size / HASH_BUCKET_PAGE_SIZE > HASH_FILE_EVICT_BATCH ? cache_size / HASH_BUCKET_PAGE_SIZE : HASH_FILE_EVICT_BATCH;
+
+	// the pages in memory now weren't counted, starting from none makes the count exact
+	uint64_t pages = f->header->next_page - 1;
+	if (pages && !_hash_file_drop_pages(f, 1, pages))
+		return false;
+	memset(f->cache, 0, f->reserved_pages);
+	f->resident_pages = 0;
+
+	ctx->touch_page = _hash_file_touch_page;
+	ctx->prefetch_page = _hash_file_prefetch_page;
+	ctx->evict_pages = _hash_file_evict_pages;
+	return true;
+}
+
+static uint64_t _hash_log_checksum(uint32_t size, uint32_t version, const uint8_t* changes) {
+	// FNV-1a, seeded with the header so a group can't pass for one of another size or time
+	uint64_t h = 0xcbf29ce484222325ull ^ ((uint64_t)version << 32 | size);
+	for (uint32_t i = 0; i < size; i++)
+		h = (h ^ changes[i]) * 0x100000001b3ull;
+	return h;
+}
+
+static bool _hash_file_log_flush(hash_ctx_t* ctx) {
+	hash_file_t* f = ctx->page_state;
+	if (!f->log_count)
+		return true;
+	hash_log_group_t* group = (hash_log_group_t*)f->log_buffer;
+	group->size = f->log_size;
+	group->version = ctx->dir->version;
+	group->checksum = _hash_log_checksum(group->size, group->version, f->log_buffer + sizeof(hash_log_group_t));
+
+	size_t size = sizeof(hash_log_group_t) + f->log_size;
+	for (size_t written = 0; written < size;)
+	{
+		ssize_t n = write(f->log_fd, f->log_buffer + written, size - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			// a partial group would hide the ones after it, the next try writes it whole again
+			int error = errno;
+			if (ftruncate(f->log_fd, (off_t)f->log_file_size)) {}
+			errno = error;
+			return false;
+		}
+		written += n;
+	}
+	if (fdatasync(f->log_fd))
+		return false;
+	f->log_file_size += size;
+	f->log_size = f->log_count = 0;
+	return true;
+}
+
+static bool _hash_file_log_change(hash_ctx_t* ctx, hash_change_t change, uint64_t key, uint64_t value) {
+	hash_file_t* f = ctx->page_state;
+	// a group that failed to go out is kept, and grows until one does
+	if (sizeof(hash_log_group_t) + f->log_size + HASH_LOG_CHANGE_MAX_SIZE > f->log_capacity) {
+		uint8_t* buffer = realloc(f->log_buffer, (size_t)f->log_capacity * 2);
+		if (!buffer) {
+			errno = ENOMEM;
+			return false;
+		}
+		f->log_buffer = buffer;
+		f->log_capacity *= 2;
+	}
+	uint8_t* buf = f->log_buffer + sizeof(hash_log_group_t) + f->log_size;
+	uint8_t* start = buf;
+	*buf++ = (uint8_t)change;
+	varint_encode(key, &buf);
+	if (change != HASH_CHANGE_DELETE)
+		varint_encode(value, &buf);
+	f->log_size += (uint32_t)(buf - start);
+	if (++f->log_count < f->log_group_size)
+		return true;
+	if (!_hash_file_log_flush(ctx))
+		return false;
+	return f->log_file_size < HASH_LOG_CHECKPOINT_SIZE || hash_table_checkpoint(ctx);
+}
+
+// applies the groups logged after version, up to the first one a crash tore
+static bool _hash_file_log_replay(hash_ctx_t* ctx, uint32_t version) {
+	hash_file_t* f = ctx->page_state;
+	struct stat st;
+	if (fstat(f->log_fd, &st))
+		return false;
+	size_t size = (size_t)st.st_size;
+	uint8_t* log = malloc(size ? size : 1);
+	if (!log)
+		return false;
+	for (size_t read = 0; read < size;)
+	{
+		ssize_t n = pread(f->log_fd, log + read, size - read, (off_t)read);
+		if (n <= 0 && !(n < 0 && errno == EINTR)) {
+			free(log);
+			if (n == 0)
+				errno = EIO;
+			return false;
+		}
+		if (n > 0)
+			read += n;
+	}
+
+	bool result = true;
+	for (size_t pos = 0; result && pos + sizeof(hash_log_group_t) <= size;)
+	{
+		hash_log_group_t group;
+		memcpy(&group, log + pos, sizeof(hash_log_group_t));
+		uint8_t* buf = log + pos + sizeof(hash_log_group_t);
+		if (group.size > size - pos - sizeof(hash_log_group_t) ||
+			group.checksum != _hash_log_checksum(group.size, group.version, buf))
+			break; // never synced, so no call that made these changes returned
+		pos += sizeof(hash_log_group_t) + group.size;
+		// the groups before the checkpoint are left when a crash beats emptying the log
+		if ((int32_t)(group.version - version) <= 0)
+			continue;
+		uint8_t* end = buf + group.size;
+		while (result && buf < end)
+		{
+			uint8_t change = *buf++;
+			uint64_t key, value = 0;
+			varint_decode(&buf, &key);
+			if (change != HASH_CHANGE_DELETE)
+				varint_decode(&buf, &value);
+			// a delete or a remove is false for what is already gone
+			switch (change) {
+			case HASH_CHANGE_PUT:
+				result = hash_table_put(ctx, key, value);
+				break;
+			case HASH_CHANGE_ADD:
+				result = hash_table_add(ctx, key, value);
+				break;
+			case HASH_CHANGE_REMOVE_VALUE:
+				hash_table_remove_value(ctx, key, value);
+				break;
+			default:
+				hash_table_delete(ctx, key, NULL);
+			}
+		}
+	}
+	free(log);
+	return result;
+}
+
+bool hash_table_commit(hash_ctx_t* ctx) {
+	hash_file_t* f = ctx->page_state;
+	if (f->log_fd < 0) {
+		errno = EINVAL;
+		return false;
+	}
+	return _hash_file_log_flush(ctx);
+}
+
+bool hash_table_checkpoint(hash_ctx_t* ctx) {
+	hash_file_t* f = ctx->page_state;
+	if (f->log_fd < 0) {
+		errno = EINVAL;
+		return false;
+	}
+	if (!_hash_file_log_flush(ctx))
+		return false;
+	hash_table_maintenance(ctx, SIZE_MAX);
+
+	if (f->checkpoints_count == f->checkpoints_capacity) {
+		uint32_t capacity = f->checkpoints_capacity ? f->checkpoints_capacity * 2 : 2;
+		hash_snapshot_t** checkpoints = realloc(f->checkpoints, capacity * sizeof(hash_snapshot_t*));
+		if (!checkpoints) {
+			errno = ENOMEM;
+			return false;
+		}
+		f->checkpoints = checkpoints;
+		f->checkpoints_capacity = capacity;
+	}
+	hash_snapshot_t* checkpoint = hash_table_snapshot(ctx);
+	if (!checkpoint)
+		return false;
+	// its pages go to disk before the header names it
+	if (msync(f->base, f->header->next_page * HASH_BUCKET_PAGE_SIZE, MS_SYNC)) {
+		hash_snapshot_release(checkpoint);
+		return false;
+	}
+	f->header->checkpoint_dir_page = hash_page_ref(ctx, checkpoint->dir);
+	f->header->checkpoint_next_page = f->header->next_page;
+	f->header->checkpoint_version = checkpoint->dir->version;
+	f->checkpoints[f->checkpoints_count++] = checkpoint;
+	// until the header is known to be on disk, any checkpoint since the last one that was may be the one it names
+	if (msync(f->base, HASH_BUCKET_PAGE_SIZE, MS_SYNC))
+		return false;
+	for (uint32_t i = 0; i < f->checkpoints_count - 1; i++)
+		hash_snapshot_release(f->checkpoints[i]);
+	f->checkpoints[0] = checkpoint;
+	f->checkpoints_count = 1;
+
+	// the groups left if this doesn't make it to disk are older than the checkpoint
+	if (ftruncate(f->log_fd, 0))
+		return false;
+	f->log_file_size = 0;
+	return true;
+}
+
+bool hash_table_open_file_logged(hash_ctx_t* ctx, const char* path, uint64_t max_size, const char* log_path, uint32_t group_size) {
+	if (!group_size) {
+		errno = EINVAL;
+		return false;
+	}
+	bool recovering;
+	if (!_hash_file_open(ctx, path, max_size, true, &recovering))
+		return false;
+	hash_file_t* f = ctx->page_state;
+	f->log_group_size = group_size;
+	f->log_capacity = sizeof(hash_log_group_t) + group_size * HASH_LOG_CHANGE_MAX_SIZE;
+	f->log_buffer = malloc(f->log_capacity);
+	f->log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (!f->log_buffer || f->log_fd < 0)
+		goto fail;
+
+	// the table as the header's checkpoint has it, protected from the replay until the one below
+	f->checkpoints = malloc(2 * sizeof(hash_snapshot_t*));
+	if (!f->checkpoints || !(f->checkpoints[0] = hash_table_snapshot(ctx)))
+		goto fail;
+	f->checkpoints_count = 1;
+	f->checkpoints_capacity = 2;
+	if (recovering && !_hash_file_log_replay(ctx, f->header->checkpoint_version))
+		goto fail;
+	ctx->log_change = _hash_file_log_change;
+	if (!hash_table_checkpoint(ctx))
+		goto fail;
+	return true;
+
+fail:
+	// the file is left as it was found, the next open recovers it again
+	_hash_file_drop_table(ctx);
+	return false;
+}
+
+typedef struct hash_file_writer {
+	int fd;
+	int count;
+	struct iovec pages[HASH_FILE_SAVE_BATCH];
+} hash_file_writer_t;
+
+static bool _hash_file_writer_flush(hash_file_writer_t* w) {
+	struct iovec* iov = w->pages;
+	int count = w->count;
+	w->count = 0;
+	while (count)
+	{
+		ssize_t n = writev(w->fd, iov, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return false;
+		// a pipe or a socket can take part of it, the rest goes from where it stopped
+		for (; count && (size_t)n >= iov->iov_len; count--, iov++)
+			n -= iov->iov_len;
+		if (count) {
+			iov->iov_base = (uint8_t*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+// the pages are only read at the next flush, a page in a buffer that is about to be reused
+// is written with flush set
+static bool _hash_file_writer_add(hash_file_writer_t* w, const void* pages, uint32_t n, bool flush) {
+	w->pages[w->count].iov_base = (void*)pages;
+	w->pages[w->count].iov_len = (size_t)n * HASH_BUCKET_PAGE_SIZE;
+	return ++w->count < HASH_FILE_SAVE_BATCH && !flush ? true : _hash_file_writer_flush(w);
+}
+
+// the runs of a multimap's buckets follow the buckets, in the same order
+typedef struct hash_file_runs {
+	hash_file_writer_t* w;
+	uint64_t number;
+	bool failed;
+} hash_file_runs_t;
+
+static void _hash_file_count_run(hash_ctx_t* ctx, uint8_t* ref, void* arg) {
+	hash_page_ref_t r;
+	memcpy(&r, ref, sizeof(hash_page_ref_t));
+	((hash_file_runs_t*)arg)->number += ((hash_value_run_t*)hash_page_at(ctx, r))->pages;
+}
+
+// ref is in a copy of the bucket, it gets the run's saved page
+static void _hash_file_number_run(hash_ctx_t* ctx, uint8_t* ref, void* arg) {
+	hash_file_runs_t* runs = arg;
+	hash_page_ref_t r;
+	memcpy(&r, ref, sizeof(hash_page_ref_t));
+	memcpy(ref, &runs->number, sizeof(hash_page_ref_t));
+	runs->number += ((hash_value_run_t*)hash_page_at(ctx, r))->pages;
+}
+
+static void _hash_file_write_run(hash_ctx_t* ctx, uint8_t* ref, void* arg) {
+	hash_file_runs_t* runs = arg;
+	hash_page_ref_t r;
+	memcpy(&r, ref, sizeof(hash_page_ref_t));
+	hash_value_run_t* run = (hash_value_run_t*)hash_page_at(ctx, r);
+	runs->failed = runs->failed || !_hash_file_writer_add(runs->w, run, run->pages, false);
+}
+
+bool hash_table_save(hash_ctx_t* ctx, int fd) {
+	hash_directory_t* dir = ctx->dir;
+	size_t capacity = (((size_t)dir->directory_pages * HASH_BUCKET_PAGE_SIZE) - sizeof(hash_directory_t)) / sizeof(hash_page_ref_t);
+	uint64_t* slots = malloc(dir->number_of_buckets * sizeof(uint64_t)); // the saved page of each slot's bucket
+	uint8_t* directory = malloc((size_t)dir->directory_pages * HASH_BUCKET_PAGE_SIZE);
+	uint8_t* page = malloc(HASH_BUCKET_PAGE_SIZE);
+	hash_file_writer_t* w = malloc(sizeof(hash_file_writer_t));
+	bool result = false;
+	if (!slots || !directory || !page || !w) {
+		errno = ENOMEM;
+		goto done;
+	}
+	w->fd = fd;
+	w->count = 0;
+
+	// the header, the directory, the segments and the buckets, each bucket once, in the order of
+	// the first slot it has, so the directory is written with their numbers up front
+	uint64_t number = 1 + dir->directory_pages;
+	memcpy(directory, dir, (size_t)dir->directory_pages * HASH_BUCKET_PAGE_SIZE);
+	hash_directory_t* saved = (hash_directory_t*)directory;
+	for (size_t s = 0; s < capacity; s++)
+	{
+		if (saved->segments[s])
+			saved->segments[s] = number++;
+	}
+	for (size_t i = 0; i < dir->number_of_buckets; i++)
+	{
+		hash_bucket_t* b = hash_directory_bucket(ctx, dir, i);
+		size_t first = i & (((size_t)1 << b->depth) - 1);
+		slots[i] = first == i ? number++ : slots[first];
+	}
+	hash_file_runs_t runs = { .w = w, .number = number };
+	for (size_t i = 0; i < dir->number_of_buckets; i++)
+	{
+		hash_bucket_t* b = hash_directory_bucket(ctx, dir, i);
+		if (i < ((size_t)1 << b->depth))
+			hash_bucket_for_each_run(ctx, b, _hash_file_count_run, &runs);
+	}
+	uint64_t total = runs.number;
+	runs.number = number;
+
+	memset(page, 0, HASH_BUCKET_PAGE_SIZE);
+	hash_file_header_t* header = (hash_file_header_t*)page;
+	header->magic = HASH_FILE_MAGIC;
+	header->version = HASH_FILE_VERSION;
+	header->page_size = HASH_BUCKET_PAGE_SIZE;
+	header->pieces_per_bucket = NUMBER_OF_HASH_BUCKET_PIECES;
+	header->clean = 1;
+	header->number_of_pages = header->next_page = total;
+	header->dir_page = 1;
+	if (!_hash_file_writer_add(w, page, 1, true) ||
+		!_hash_file_writer_add(w, directory, dir->directory_pages, true))
+		goto done;
+
+	for (size_t s = 0; s < capacity; s++)
+	{
+		if (!dir->segments[s])
+			continue;
+		hash_page_ref_t* segment = (hash_page_ref_t*)page;
+		for (size_t j = 0; j < HASH_DIRECTORY_SEGMENT_SLOTS; j++)
+		{
+			size_t i = s * HASH_DIRECTORY_SEGMENT_SLOTS + j;
+			segment[j] = i < dir->number_of_buckets ? slots[i] : 0;
+		}
+		if (!_hash_file_writer_add(w, page, 1, true))
+			goto done;
+	}
+
+	for (size_t i = 0; i < dir->number_of_buckets; i++)
+	{
+		hash_bucket_t* b = hash_directory_bucket(ctx, dir, i);
+		if (i >= ((size_t)1 << b->depth))
+			continue;
+		if (!b->compaction_pending && ctx->layout != HASH_LAYOUT_MULTIMAP) {
+			if (!_hash_file_writer_add(w, b, 1, false))
+				goto done;
+			continue;
+		}
+		// opened for writing, the table has no list of the marked buckets
+		memcpy(page, b, HASH_BUCKET_PAGE_SIZE);
+		((hash_bucket_t*)page)->compaction_pending = false;
+		hash_bucket_for_each_run(ctx, (hash_bucket_t*)page, _hash_file_number_run, &runs);
+		if (!_hash_file_writer_add(w, page, 1, true))
+			goto done;
+	}
+
+	for (size_t i = 0; i < dir->number_of_buckets && !runs.failed; i++)
+	{
+		hash_bucket_t* b = hash_directory_bucket(ctx, dir, i);
+		if (i < ((size_t)1 << b->depth))
+			hash_bucket_for_each_run(ctx, b, _hash_file_write_run, &runs);
+	}
+	result = !runs.failed && _hash_file_writer_flush(w);
+
+done:
+	free(w);
+	free(page);
+	free(directory);
+	free(slots);
+	return result;
+}
+
+bool hash_table_load_mmap(hash_ctx_t* ctx, const char* path) {
+	hash_file_t* f = _hash_file_new(0);
+	if (!f)
+		return false;
+	f->fd = open(path, O_RDONLY);
+	struct stat st;
+	if (f->fd < 0 || fstat(f->fd, &st))
+		goto fail;
+	f->reserved_pages = (uint64_t)st.st_size / HASH_BUCKET_PAGE_SIZE;
+	if (!f->reserved_pages) {
+		errno = EINVAL;
+		goto fail;
+	}
+	f->base = mmap(NULL, f->reserved_pages * HASH_BUCKET_PAGE_SIZE, PROT_READ, MAP_SHARED, f->fd, 0);
+	if (f->base == MAP_FAILED)
+		goto fail;
+	f->header = (hash_file_header_t*)f->base;
+	if (f->header->magic != HASH_FILE_MAGIC ||
+		f->header->version != HASH_FILE_VERSION ||
+		f->header->page_size != HASH_BUCKET_PAGE_SIZE ||
+		f->header->pieces_per_bucket != NUMBER_OF_HASH_BUCKET_PIECES ||
+		f->header->number_of_pages > f->reserved_pages ||
+		!f->header->clean ||
+		!f->header->dir_page || f->header->dir_page >= f->header->number_of_pages) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	// the pages can't be written, there is nothing to allocate them for
+	ctx->allocate_page = NULL;
+	ctx->release_page = NULL;
+	ctx->page_state = f;
+	ctx->base = f->base;
+	ctx->touch_page = NULL;
+	ctx->prefetch_page = NULL;
+	ctx->evict_pages = NULL;
+	ctx->log_change = NULL;
+	ctx->read_only = true;
+	_hash_file_attach_table(ctx, f->header->dir_page);
+	return true;
+
+fail:
+	_hash_file_close(f);
+	return false;
+}
+
+bool hash_table_close_file(hash_ctx_t* ctx) {
+	hash_file_t* f = ctx->page_state;
+	if (ctx->read_only) {
+		_hash_file_drop_table(ctx);
+		ctx->read_only = false;
+		return true;
+	}
+	// a last checkpoint, whose pages are the table's, so letting go of it frees none of them
+	bool result = f->log_fd < 0 || hash_table_checkpoint(ctx);
+	if (result) {
+		for (uint32_t i = 0; i < f->checkpoints_count; i++)
+			hash_snapshot_release(f->checkpoints[i]);
+		f->checkpoints_count = 0;
+	}
+	// the marks would outlive the list of the buckets that have them
+	hash_table_maintenance(ctx, SIZE_MAX);
+	hash_table_release_retired(ctx);
+
+	result = result && hash_table_sync_file(ctx);
+	if (result) {
+		// the header goes last, so the file is marked clean only if everything else is on disk
+		f->header->clean = 1;
+		result = msync(f->base, HASH_BUCKET_PAGE_SIZE, MS_SYNC) == 0;
+	}
+	_hash_file_drop_table(ctx);
+	return result;
+}
@@ -3,6 +3,7 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "ehash.h"
 
@@ -33,49 +34,851 @@ void varint_encode(uint64_t val, uint8_t** buf) {
 }
 
 
+// the directory slot, the piece and the split bits all come from the mixed key, the key
+// itself is what is stored
+static inline uint64_t _hash_table_hash(hash_ctx_t* ctx, uint64_t key) {
+	return hash_key_mix(ctx->mix, key);
+}
+
+// The entries are written in the table's layout, varints or fixed widths. Key before value
+// either way, so code that moves whole entries doesn't care which. A set has no value, it reads
+// as 0 and is the only one it takes. The value of a multimap's entry is all of its key's values,
+// it reads as their count and is written by hash_table_add alone.
+
+static inline bool _hash_table_varint_keys(hash_ctx_t* ctx) {
+	return ctx->layout != HASH_LAYOUT_FIXED_8_4 && ctx->layout != HASH_LAYOUT_FIXED_8_8;
+}
+
+// A multimap entry is the key, then count << 1, the size of the values and the values, or once
+// they outgrew HASH_MULTIMAP_INLINE_SIZE, 1, the page ref of their run and the count, 8 bytes
+// each so the entry keeps its size while the run changes. Never reads past the entry, a torn
+// copy of it can't send the decoding anywhere but further along.
+static inline void _hash_multimap_skip_values(uint8_t** buf, uint64_t* count) {
+	uint64_t header;
+	varint_decode(buf, &header);
+	if (header & 1) {
+		memcpy(count, *buf + sizeof(hash_page_ref_t), sizeof(uint64_t));
+		*buf += sizeof(hash_page_ref_t) + sizeof(uint64_t);
+		return;
+	}
+	uint64_t size;
+	varint_decode(buf, &size);
+	*buf += size;
+	*count = header >> 1;
+}
+
+static inline void _hash_table_write_key(hash_ctx_t* ctx, uint64_t key, uint8_t** buf) {
+	if (_hash_table_varint_keys(ctx)) {
+		varint_encode(key, buf);
+		return;
+	}
+	memcpy(*buf, &key, sizeof(uint64_t));
+	*buf += sizeof(uint64_t);
+}
+
+static inline void _hash_table_write_value(hash_ctx_t* ctx, uint64_t value, uint8_t** buf) {
+	switch (ctx->layout) {
+	case HASH_LAYOUT_FIXED_8_4: {
+		uint32_t v = (uint32_t)value;
+		memcpy(*buf, &v, sizeof(uint32_t));
+		*buf += sizeof(uint32_t);
+		break;
+	}
+	case HASH_LAYOUT_FIXED_8_8:
+		memcpy(*buf, &value, sizeof(uint64_t));
+		*buf += sizeof(uint64_t);
+		break;
+	case HASH_LAYOUT_KEYS:
+		break;
+	default:
+		varint_encode(value, buf);
+	}
+}
+
+static inline void _hash_table_read_key(hash_ctx_t* ctx, uint8_t** buf, uint64_t* key) {
+	if (_hash_table_varint_keys(ctx)) {
+		varint_decode(buf, key);
+		return;
+	}
+	memcpy(key, *buf, sizeof(uint64_t));
+	*buf += sizeof(uint64_t);
+}
+
+static inline void _hash_table_read_value(hash_ctx_t* ctx, uint8_t** buf, uint64_t* value) {
+	switch (ctx->layout) {
+	case HASH_LAYOUT_FIXED_8_4: {
+		uint32_t v;
+		memcpy(&v, *buf, sizeof(uint32_t));
+		*buf += sizeof(uint32_t);
+		*value = v;
+		break;
+	}
+	case HASH_LAYOUT_FIXED_8_8:
+		memcpy(value, *buf, sizeof(uint64_t));
+		*buf += sizeof(uint64_t);
+		break;
+	case HASH_LAYOUT_KEYS:
+		*value = 0;
+		break;
+	case HASH_LAYOUT_MULTIMAP:
+		_hash_multimap_skip_values(buf, value);
+		break;
+	default:
+		varint_decode(buf, value);
+	}
+}
+
+static inline uint8_t _varint_size(uint64_t v) {
+	return (uint8_t)(1 + (63 - __builtin_clzll(v | 1)) / 7);
+}
+
+static inline bool _hash_table_value_fits(hash_ctx_t* ctx, uint64_t value) {
+	switch (ctx->layout) {
+	case HASH_LAYOUT_FIXED_8_4:
+		return value <= UINT32_MAX;
+	case HASH_LAYOUT_KEYS:
+		return value == 0;
+	case HASH_LAYOUT_MULTIMAP:
+		return false;
+	default:
+		return true;
+	}
+}
+
+static inline uint8_t _hash_table_entry_size(hash_ctx_t* ctx, uint64_t key, uint64_t value) {
+	switch (ctx->layout) {
+	case HASH_LAYOUT_FIXED_8_4:
+		return sizeof(uint64_t) + sizeof(uint32_t);
+	case HASH_LAYOUT_FIXED_8_8:
+		return sizeof(uint64_t) * 2;
+	case HASH_LAYOUT_KEYS:
+		return _varint_size(key);
+	default:
+		return _varint_size(key) + _varint_size(value);
+	}
+}
+
+// With compress_keys a bucket stores hash >> depth in place of the key, the bits shifted out are
+// the bucket's prefix, and the key is recovered by undoing the mix. The stored form of a key
+// depends on the depth, so it changes when its bucket is split or merged.
+static inline uint64_t _hash_bucket_stored_key(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t key, uint64_t hash) {
+	return ctx->compress_keys ? hash >> b->depth : key;
+}
+
+static inline uint64_t _hash_bucket_entry_hash(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t stored) {
+	return ctx->compress_keys ? (stored << b->depth) | b->prefix : _hash_table_hash(ctx, stored);
+}
+
+static inline uint64_t _hash_bucket_entry_key(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t stored) {
+	return ctx->compress_keys ? hash_key_unmix(ctx->mix, (stored << b->depth) | b->prefix) : stored;
+}
+
+// encodes the stored form of key in b, returns its size
+static inline uint8_t _hash_bucket_encode_key(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t key, uint64_t hash, uint8_t* buffer) {
+	uint8_t* end = buffer;
+	_hash_table_write_key(ctx, _hash_bucket_stored_key(ctx, b, key, hash), &end);
+	return (uint8_t)(end - buffer);
+}
+
 static inline uint32_t _hash_table_bucket_number(hash_ctx_t* ctx, uint64_t h) {
 	return h & (((uint64_t)1 << ctx->dir->depth) - 1);
 }
 
-static inline size_t _hash_table_get_directory_capacity(hash_ctx_t* ctx) {
-	return (((size_t)ctx->dir->directory_pages * HASH_BUCKET_PAGE_SIZE) - sizeof(hash_directory_t)) / sizeof(hash_bucket_t*);
+// how many segment refs the directory pages have room for
+static inline size_t _hash_table_get_directory_capacity(hash_directory_t* dir) {
+	return (((size_t)dir->directory_pages * HASH_BUCKET_PAGE_SIZE) - sizeof(hash_directory_t)) / sizeof(hash_page_ref_t);
+}
+
+static inline size_t _hash_table_segments_for(size_t number_of_buckets) {
+	return (number_of_buckets + HASH_DIRECTORY_SEGMENT_SLOTS - 1) >> HASH_DIRECTORY_SEGMENT_BITS;
+}
+
+// Stats: the counters are striped, a thread counts into the stripe of its epoch slot, with relaxed
+// atomics in concurrent mode since more threads than stripes end up sharing them
+
+#if HASH_STATS
+static inline hash_stats_t* _hash_table_stats(hash_ctx_t* ctx) {
+	if (!ctx->concurrent)
+		return &ctx->stats[0].stats;
+	int32_t slot = hash_epoch_thread_slot();
+	return &ctx->stats[slot < 0 ? 0 : slot % HASH_STATS_STRIPES].stats;
+}
+
+static inline void _hash_stat_add(hash_ctx_t* ctx, uint64_t* counter, uint64_t n) {
+	if (ctx->concurrent)
+		__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+	else
+		*counter += n;
+}
+
+#define HASH_STAT_ADD(ctx, field, n) _hash_stat_add((ctx), &_hash_table_stats(ctx)->field, (n))
+#else
+#define HASH_STAT_ADD(ctx, field, n) ((void)0)
+#endif
+
+// pieces is how many were scanned, 0 when the filter answered
+static inline void _hash_table_count_get(hash_ctx_t* ctx, size_t pieces, bool filtered, bool found) {
+#if HASH_STATS
+	hash_stats_t* stats = _hash_table_stats(ctx);
+	_hash_stat_add(ctx, &stats->gets, 1);
+	if (filtered) {
+		_hash_stat_add(ctx, &stats->filter_rejects, 1);
+		return;
+	}
+	_hash_stat_add(ctx, &stats->get_pieces, pieces);
+	if (pieces > 1)
+		_hash_stat_add(ctx, &stats->get_overflow_pieces, pieces - 1);
+	if (!found)
+		_hash_stat_add(ctx, &stats->filter_false_positives, 1);
+#endif
+}
+
+// all the pages of the table come and go through these two, so they can be counted
+static void* _hash_table_allocate_pages(hash_ctx_t* ctx, uint32_t n) {
+	void* p = ctx->allocate_page(ctx, n);
+	if (p)
+		HASH_STAT_ADD(ctx, pages_allocated, n);
+	return p;
+}
+
+static void _hash_table_free_pages(hash_ctx_t* ctx, void* p, uint32_t n) {
+	HASH_STAT_ADD(ctx, pages_released, n);
+	ctx->release_page(ctx, p, n);
 }
 
 static hash_bucket_t* _create_hash_bucket(hash_ctx_t* ctx) {
-	hash_bucket_t* b = ctx->allocate_page(1);
+	hash_bucket_t* b = _hash_table_allocate_pages(ctx, 1);
 	if (b == NULL)
 		return NULL;
 
 	memset(b, 0, sizeof(hash_bucket_t));
 	b->depth = ctx->dir->depth;
+	b->generation = ctx->dir->generation;
 	return b;
 }
 
-bool hash_table_get(hash_ctx_t* ctx, uint64_t key, uint64_t* value) {
-	uint32_t bucket_idx = _hash_table_bucket_number(ctx, key);
-	hash_bucket_t* b = ctx->dir->buckets[bucket_idx];
-	uint32_t piece_idx = key % NUMBER_OF_HASH_BUCKET_PIECES;
+// Each bucket has a blocked bloom filter of its keys, a key sets HASH_BUCKET_FILTER_HASHES bits
+// in a single 64 byte line, so a lookup of a missing key usually reads that line and no pieces.
+// Deleted keys stay in the filter until there are enough of them to rebuild it.
+
+static inline uint64_t _hash_bucket_filter_hash(uint64_t key) {
+	// the keys of a bucket share the low bits of their mixed hash, so the filter hashes the key
+	// on its own, with a function unrelated to any of the key mixers
+	uint64_t h = key * 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	return h ^ (h >> 33);
+}
+
+static inline uint64_t* _hash_bucket_filter_line(hash_bucket_t* b, uint64_t h) {
+	return &b->filter[(((h >> 32) * HASH_BUCKET_FILTER_LINES) >> 32) * 8];
+}
+
+static inline void _hash_bucket_filter_add(hash_bucket_t* b, uint64_t key) {
+#if HASH_BUCKET_FILTER_LINES
+	uint64_t h = _hash_bucket_filter_hash(key);
+	uint64_t* line = _hash_bucket_filter_line(b, h);
+	for (int i = 0; i < HASH_BUCKET_FILTER_HASHES; i++, h >>= 9)
+		line[(h >> 6) & 7] |= (uint64_t)1 << (h & 63);
+#endif
+}
+
+static inline bool _hash_bucket_filter_may_contain(hash_bucket_t* b, uint64_t key) {
+#if HASH_BUCKET_FILTER_LINES
+	uint64_t h = _hash_bucket_filter_hash(key);
+	uint64_t* line = _hash_bucket_filter_line(b, h);
+	for (int i = 0; i < HASH_BUCKET_FILTER_HASHES; i++, h >>= 9)
+	{
+		if (!(line[(h >> 6) & 7] & ((uint64_t)1 << (h & 63))))
+			return false;
+	}
+#endif
+	return true;
+}
 
+static void _hash_bucket_filter_rebuild(hash_ctx_t* ctx, hash_bucket_t* b) {
+	memset(b->filter, 0, sizeof(b->filter));
+	b->filter_deletes = 0;
 	for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++)
 	{
-		hash_bucket_piece_t* p = &b->pieces[(piece_idx + i) % NUMBER_OF_HASH_BUCKET_PIECES];
-		uint8_t* buf = p->data;
-		uint8_t* end = p->data + p->bytes_used;
+		uint8_t* buf = b->pieces[i].data;
+		uint8_t* end = buf + b->pieces[i].bytes_used;
 		while (buf < end)
 		{
 			uint64_t k, v;
+			_hash_table_read_key(ctx, &buf, &k);
+			_hash_table_read_value(ctx, &buf, &v);
+			_hash_bucket_filter_add(b, _hash_bucket_entry_key(ctx, b, k));
+		}
+	}
+}
+
+// Concurrent mode: readers never lock, they read the bucket's seq before and after scanning it
+// and retry if a writer was active in between, writers are serialized by the caller
+
+static inline void _hash_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline void _hash_bucket_write_begin(hash_ctx_t* ctx, hash_bucket_t* b) {
+	if (!ctx->concurrent)
+		return;
+	__atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void _hash_bucket_write_end(hash_ctx_t* ctx, hash_bucket_t* b) {
+	if (!ctx->concurrent)
+		return;
+	__atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void _hash_table_reclaim_pages(hash_ctx_t* ctx, uint64_t min_active) {
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < ctx->retired_count; i++)
+	{
+		if (ctx->retired[i].epoch < min_active)
+			_hash_table_free_pages(ctx, ctx->retired[i].page, ctx->retired[i].pages);
+		else
+			ctx->retired[kept++] = ctx->retired[i];
+	}
+	ctx->retired_count = kept;
+}
+
+// in concurrent mode a reader may still be holding on to an unlinked page, so it is released
+// only after all the readers active now are done
+static void _hash_table_retire_page(hash_ctx_t* ctx, void* p, uint32_t pages) {
+	if (!ctx->concurrent) {
+		_hash_table_free_pages(ctx, p, pages);
+		return;
+	}
+	uint64_t epoch = hash_epoch_retire();
+	if (ctx->retired_count == ctx->retired_capacity) {
+		uint32_t capacity = ctx->retired_capacity ? ctx->retired_capacity * 2 : 64;
+		hash_retired_page_t* retired = realloc(ctx->retired, capacity * sizeof(hash_retired_page_t));
+		if (!retired) {
+			// nowhere to remember the page, so wait out the readers instead
+			while (hash_epoch_min_active() <= epoch)
+				_hash_cpu_relax();
+			_hash_table_free_pages(ctx, p, pages);
+			return;
+		}
+		ctx->retired = retired;
+		ctx->retired_capacity = capacity;
+	}
+	ctx->retired[ctx->retired_count].page = p;
+	ctx->retired[ctx->retired_count].pages = pages;
+	ctx->retired[ctx->retired_count].epoch = epoch;
+	ctx->retired_count++;
+	_hash_table_reclaim_pages(ctx, hash_epoch_min_active());
+}
+
+// Copy on write: a page written in generation g is in the snapshots of g and later, until the
+// table lets go of it. Taking a snapshot doesn't touch the table, the first write after it copies
+// the directory and moves it to the next generation, and every page written from then on is
+// copied first if it is older than the newest snapshot. A page the table lets go of stays in
+// ctx->shared while a snapshot of a generation it was alive in is open.
+
+static inline bool _hash_table_is_shared(hash_ctx_t* ctx, uint32_t generation) {
+	// the snapshots are oldest first, the newest has everything older than it
+	return ctx->snapshots_count && ctx->snapshots[ctx->snapshots_count - 1] >= generation;
+}
+
+// whether one of the open snapshots is of a generation in born .. dropped - 1
+static bool _hash_table_snapshot_reads(hash_ctx_t* ctx, uint32_t born, uint32_t dropped) {
+	for (uint32_t i = 0; i < ctx->snapshots_count; i++)
+	{
+		if (ctx->snapshots[i] >= born && ctx->snapshots[i] < dropped)
+			return true;
+	}
+	return false;
+}
+
+// called once the page is unreachable from ctx->dir, generation is the page's
+static void _hash_table_release_page(hash_ctx_t* ctx, void* p, uint32_t pages, uint32_t generation) {
+	if (!_hash_table_is_shared(ctx, generation)) {
+		_hash_table_retire_page(ctx, p, pages);
+		return;
+	}
+	if (ctx->shared_count == ctx->shared_capacity) {
+		uint32_t capacity = ctx->shared_capacity ? ctx->shared_capacity * 2 : 64;
+		hash_shared_page_t* shared = realloc(ctx->shared, capacity * sizeof(hash_shared_page_t));
+		if (!shared)
+			return; // a snapshot still reads it, leaking the page is all we can do
+		ctx->shared = shared;
+		ctx->shared_capacity = capacity;
+	}
+	ctx->shared[ctx->shared_count].page = p;
+	ctx->shared[ctx->shared_count].pages = pages;
+	ctx->shared[ctx->shared_count].born = generation;
+	ctx->shared[ctx->shared_count].dropped = ctx->dir->generation;
+	ctx->shared_count++;
+}
+
+// The runs of a multimap follow the pages' rules: one that a snapshot (or a concurrent reader,
+// for anything but an append) may be reading is copied before it is written, and it is released
+// with the generation it was written in, once the table's entry no longer points to it.
+
+static inline hash_value_run_t* _hash_multimap_run_at(hash_ctx_t* ctx, const uint8_t* ref) {
+	hash_page_ref_t r;
+	memcpy(&r, ref, sizeof(hash_page_ref_t));
+	return (hash_value_run_t*)hash_page_at(ctx, r);
+}
+
+static inline size_t _hash_multimap_run_capacity(uint32_t pages) {
+	return (size_t)pages * HASH_BUCKET_PAGE_SIZE - sizeof(hash_value_run_t);
+}
+
+void hash_bucket_for_each_run(hash_ctx_t* ctx, hash_bucket_t* b, void (*fn)(hash_ctx_t* ctx, uint8_t* ref, void* arg), void* arg) {
+	if (ctx->layout != HASH_LAYOUT_MULTIMAP)
+		return;
+	for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++)
+	{
+		uint8_t* buf = b->pieces[i].data;
+		uint8_t* end = buf + b->pieces[i].bytes_used;
+		while (buf < end)
+		{
+			uint64_t k, count;
 			varint_decode(&buf, &k);
-			varint_decode(&buf, &v);
-			if (k == key) {
-				*value = v;
-				return true;
-			}
+			if (*buf == 1)
+				fn(ctx, buf + 1, arg);
+			_hash_multimap_skip_values(&buf, &count);
+		}
+	}
+}
+
+static void _hash_multimap_release_ref(hash_ctx_t* ctx, uint8_t* ref, void* arg) {
+	hash_value_run_t* run = _hash_multimap_run_at(ctx, ref);
+	if (*(bool*)arg)
+		_hash_table_release_page(ctx, run, run->pages, run->generation);
+	else
+		_hash_table_free_pages(ctx, run, run->pages);
+}
+
+// values is what follows the key in its entry, the entry is going away
+static void _hash_multimap_release_run(hash_ctx_t* ctx, uint8_t* values, bool unlinked) {
+	if (*values == 1)
+		_hash_multimap_release_ref(ctx, values + 1, &unlinked);
+}
+
+// a change to a key's values: the removed bytes at offset are replaced by the inserted ones
+typedef struct hash_multimap_edit {
+	uint32_t offset;
+	uint32_t removed;
+	uint8_t inserted_size;
+	uint8_t inserted[20]; // two deltas at most
+	uint64_t last; // the largest value after the change
+} hash_multimap_edit_t;
+
+// finds the first of the size bytes of deltas at data that is value or above, returns false past
+// the end. at is where its delta starts and prev the value before it.
+static bool _hash_multimap_seek(const uint8_t* data, uint32_t size, uint64_t value, uint32_t* at, uint64_t* prev, uint64_t* found, uint32_t* found_size) {
+	uint64_t cur = 0;
+	*prev = 0;
+	for (uint32_t pos = 0; pos < size;)
+	{
+		uint8_t* buf = (uint8_t*)data + pos;
+		uint64_t delta;
+		varint_decode(&buf, &delta);
+		cur += delta;
+		*found_size = (uint32_t)(buf - data) - pos;
+		if (cur >= value) {
+			*at = pos;
+			*found = cur;
+			return true;
+		}
+		*prev = cur;
+		pos += *found_size;
+	}
+	*at = size;
+	return false;
+}
+
+// false when value is already there. last is the largest value, past it there is nothing to seek.
+static bool _hash_multimap_edit_add(const uint8_t* data, uint32_t size, uint64_t count, uint64_t last, uint64_t value, hash_multimap_edit_t* edit) {
+	uint8_t* out = edit->inserted;
+	edit->removed = 0;
+	if (!count || value > last) {
+		edit->offset = size;
+		varint_encode(value - (count ? last : 0), &out);
+		edit->inserted_size = (uint8_t)(out - edit->inserted);
+		edit->last = value;
+		return true;
+	}
+	uint64_t prev, next = 0;
+	uint32_t next_size = 0;
+	_hash_multimap_seek(data, size, value, &edit->offset, &prev, &next, &next_size);
+	if (next == value)
+		return false;
+	// value goes between prev and next, next's delta is then from value
+	varint_encode(value - prev, &out);
+	varint_encode(next - value, &out);
+	edit->removed = next_size;
+	edit->inserted_size = (uint8_t)(out - edit->inserted);
+	edit->last = last;
+	return true;
+}
+
+// false when value isn't there
+static bool _hash_multimap_edit_remove(const uint8_t* data, uint32_t size, uint64_t last, uint64_t value, hash_multimap_edit_t* edit) {
+	uint64_t prev, found;
+	uint32_t found_size;
+	if (!_hash_multimap_seek(data, size, value, &edit->offset, &prev, &found, &found_size) || found != value)
+		return false;
+	uint8_t* out = edit->inserted;
+	edit->removed = found_size;
+	edit->last = last;
+	if (value == last) {
+		edit->last = prev;
+	}
+	else {
+		// the next delta takes in the removed one
+		uint8_t* buf = (uint8_t*)data + edit->offset + found_size;
+		uint64_t delta;
+		varint_decode(&buf, &delta);
+		edit->removed = (uint32_t)(buf - data) - edit->offset;
+		varint_encode(value - prev + delta, &out);
+	}
+	edit->inserted_size = (uint8_t)(out - edit->inserted);
+	return true;
+}
+
+static inline void _hash_multimap_splice(uint8_t* to, const uint8_t* data, uint32_t size, const hash_multimap_edit_t* edit) {
+	memmove(to, data, edit->offset);
+	memmove(to + edit->offset + edit->inserted_size, data + edit->offset + edit->removed, size - edit->offset - edit->removed);
+	memcpy(to + edit->offset, edit->inserted, edit->inserted_size);
+}
+
+// a new run holding the size bytes of data with edit made, NULL with errno set when there are no pages
+static hash_value_run_t* _hash_multimap_create_run(hash_ctx_t* ctx, const uint8_t* data, uint32_t size, uint64_t count, const hash_multimap_edit_t* edit, uint32_t pages) {
+	uint32_t bytes_used = size - edit->removed + edit->inserted_size;
+	while (_hash_multimap_run_capacity(pages) < bytes_used)
+		pages *= 2;
+	hash_value_run_t* run = _hash_table_allocate_pages(ctx, pages);
+	if (!run) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	run->count = count;
+	run->last = edit->last;
+	run->bytes_used = bytes_used;
+	run->pages = pages;
+	run->generation = ctx->dir->generation;
+	_hash_multimap_splice(run->data, data, size, edit);
+	return run;
+}
+
+// makes edit in the run, returns the run the entry points to now, or NULL with run left as it was.
+// In place only when nobody else can be reading it, or for an append, that a reader bounded by
+// the count it found doesn't reach.
+static hash_value_run_t* _hash_multimap_edit_run(hash_ctx_t* ctx, hash_value_run_t* run, uint64_t count, const hash_multimap_edit_t* edit) {
+	uint32_t bytes_used = run->bytes_used - edit->removed + edit->inserted_size;
+	bool append = edit->offset == run->bytes_used && !edit->removed;
+	if (bytes_used <= _hash_multimap_run_capacity(run->pages) && (append || !ctx->concurrent) &&
+		!_hash_table_is_shared(ctx, run->generation)) {
+		memmove(run->data + edit->offset + edit->inserted_size, run->data + edit->offset + edit->removed, run->bytes_used - edit->offset - edit->removed);
+		memcpy(run->data + edit->offset, edit->inserted, edit->inserted_size);
+		run->bytes_used = bytes_used;
+		run->count = count;
+		run->last = edit->last;
+		return run;
+	}
+	hash_value_run_t* copy = _hash_multimap_create_run(ctx, run->data, run->bytes_used, count, edit, run->pages);
+	if (copy)
+		_hash_table_release_page(ctx, run, run->pages, run->generation);
+	return copy;
+}
+
+static inline uint32_t _hash_table_segment_generation(hash_ctx_t* ctx, size_t s) {
+	return s < ctx->segment_generations_capacity ? ctx->segment_generations[s] : 0;
+}
+
+// segment s was just written in the current generation. Without the memory to record it, the
+// segment is taken as shared, which may cost it a needless copy but is never wrong.
+static void _hash_table_set_segment_generation(hash_ctx_t* ctx, size_t s) {
+	if (s >= ctx->segment_generations_capacity) {
+		size_t capacity = ctx->segment_generations_capacity ? ctx->segment_generations_capacity : 64;
+		while (capacity <= s)
+			capacity *= 2;
+		uint32_t* generations = realloc(ctx->segment_generations, capacity * sizeof(uint32_t));
+		if (!generations)
+			return;
+		memset(generations + ctx->segment_generations_capacity, 0, (capacity - ctx->segment_generations_capacity) * sizeof(uint32_t));
+		ctx->segment_generations = generations;
+		ctx->segment_generations_capacity = (uint32_t)capacity;
+	}
+	ctx->segment_generations[s] = ctx->dir->generation;
+}
+
+// called by every write before it touches the directory, gives the table a directory of its
+// own in a new generation if a snapshot has this one
+static bool _hash_table_unshare_directory(hash_ctx_t* ctx) {
+	if (!_hash_table_is_shared(ctx, ctx->dir->generation))
+		return true;
+	hash_directory_t* old_dir = ctx->dir;
+	hash_directory_t* dir = _hash_table_allocate_pages(ctx, old_dir->directory_pages);
+	if (!dir)
+		return false;
+	memcpy(dir, old_dir, (size_t)old_dir->directory_pages * HASH_BUCKET_PAGE_SIZE);
+	dir->generation++;
+	__atomic_store_n(&ctx->dir, dir, __ATOMIC_RELEASE);
+	_hash_table_release_page(ctx, old_dir, old_dir->directory_pages, old_dir->generation);
+	return true;
+}
+
+static bool _hash_table_unshare_segment(hash_ctx_t* ctx, size_t s) {
+	if (!_hash_table_is_shared(ctx, _hash_table_segment_generation(ctx, s)))
+		return true;
+	hash_page_ref_t* segment = _hash_table_allocate_pages(ctx, 1);
+	if (!segment)
+		return false;
+	void* old = hash_page_at(ctx, ctx->dir->segments[s]);
+	memcpy(segment, old, HASH_BUCKET_PAGE_SIZE);
+	__atomic_store_n(&ctx->dir->segments[s], hash_page_ref(ctx, segment), __ATOMIC_RELEASE);
+	_hash_table_release_page(ctx, old, 1, _hash_table_segment_generation(ctx, s));
+	_hash_table_set_segment_generation(ctx, s);
+	return true;
+}
+
+// copies the segments _hash_table_set_slots is about to write that a snapshot has, before
+// anything else changes, so a failure leaves the table as it was
+static bool _hash_table_unshare_segments(hash_ctx_t* ctx, uint64_t first, uint64_t step) {
+	if (!ctx->snapshots_count)
+		return true;
+	size_t segments = _hash_table_segments_for(ctx->dir->number_of_buckets);
+	size_t segment_step = step > HASH_DIRECTORY_SEGMENT_SLOTS ? step >> HASH_DIRECTORY_SEGMENT_BITS : 1;
+	for (size_t s = first >> HASH_DIRECTORY_SEGMENT_BITS; s < segments; s += segment_step)
+	{
+		if (ctx->dir->segments[s] && !_hash_table_unshare_segment(ctx, s))
+			return false;
+	}
+	return true;
+}
+
+// the values between a multimap's keys aren't varints the kernels can tell from keys, so its
+// pieces are walked an entry at a time
+static bool _hash_multimap_piece_find(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	uint8_t* buf = (uint8_t*)p->data;
+	uint8_t* end = buf + (p->bytes_used < PIECE_BUCKET_BUFFER_SIZE ? p->bytes_used : PIECE_BUCKET_BUFFER_SIZE);
+	while (buf < end)
+	{
+		uint8_t* start = buf;
+		while (*buf++ & 0x80);
+		bool matched = buf - start == key_size && memcmp(start, key, key_size) == 0;
+		uint64_t count;
+		_hash_multimap_skip_values(&buf, &count);
+		if (matched) {
+			*offset = (uint8_t)(start - p->data);
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline bool _hash_table_piece_find(hash_ctx_t* ctx, const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	switch (ctx->layout) {
+	case HASH_LAYOUT_FIXED_8_4:
+		return hash_piece_find_fixed(p, key, sizeof(uint64_t) + sizeof(uint32_t), offset);
+	case HASH_LAYOUT_FIXED_8_8:
+		return hash_piece_find_fixed(p, key, sizeof(uint64_t) * 2, offset);
+	case HASH_LAYOUT_KEYS:
+		return hash_piece_find_keys(p, key, key_size, offset);
+	case HASH_LAYOUT_MULTIMAP:
+		return _hash_multimap_piece_find(p, key, key_size, offset);
+	default:
+		return hash_piece_find(p, key, key_size, offset);
+	}
+}
+
+// walks the chain of pieces starting at the key's piece, looking for the encoded key, the
+// number of pieces it read goes to scanned
+static hash_bucket_piece_t* _hash_table_find_entry(hash_ctx_t* ctx, hash_bucket_t* b, uint32_t piece_idx, uint8_t* key, uint8_t key_size, uint8_t** entry, size_t* scanned) {
+	size_t i = 0;
+	hash_bucket_piece_t* found = NULL;
+	while (i < NUMBER_OF_HASH_BUCKET_PIECES)
+	{
+		hash_bucket_piece_t* p = &b->pieces[(piece_idx + i++) % NUMBER_OF_HASH_BUCKET_PIECES];
+		uint8_t offset;
+		if (_hash_table_piece_find(ctx, p, key, key_size, &offset)) {
+			*entry = p->data + offset;
+			found = p;
+			break;
 		}
 		if (!p->overflowed)
 			break;
 	}
+	*scanned = i;
+	return found;
+}
 
-	return false;
+// scanned is the number of pieces read, 0 when the filter answered
+static bool _hash_table_lookup(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t key, uint64_t hash, uint64_t* value, size_t* scanned) {
+	*scanned = 0;
+	if (!_hash_bucket_filter_may_contain(b, key))
+		return false;
+	uint8_t encoded_key[10];
+	uint8_t key_size = _hash_bucket_encode_key(ctx, b, key, hash, encoded_key);
+	uint8_t* entry = NULL;
+	if (!_hash_table_find_entry(ctx, b, hash % NUMBER_OF_HASH_BUCKET_PIECES, encoded_key, key_size, &entry, scanned))
+		return false;
+
+	entry += key_size;
+	_hash_table_read_value(ctx, &entry, value);
+	return true;
+}
+
+static bool _hash_table_get_from_bucket(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t key, uint64_t hash, uint64_t* value) {
+	size_t scanned;
+	bool found = _hash_table_lookup(ctx, b, key, hash, value, &scanned);
+	_hash_table_count_get(ctx, scanned, scanned == 0, found);
+	return found;
+}
+
+// Lock free lookup, scans copies of the pieces so a torn read can't send the decoding past the
+// piece, and accepts the result only if the bucket didn't change and is still the one the
+// directory maps the key to. Must run inside an epoch, so the pages can't be released under us.
+// With values, the bytes of the entry after the key are copied there too, as they were found.
+static bool _hash_table_get_optimistic(hash_ctx_t* ctx, uint64_t key, uint64_t hash, uint64_t* value, uint8_t* values) {
+	struct {
+		_Alignas(64) hash_bucket_piece_t piece;
+		uint8_t guard[32]; // zeros end any varint, a multimap's 16 fixed bytes are covered too
+	} copy;
+	memset(copy.guard, 0, sizeof copy.guard);
+
+	uint32_t piece_idx = hash % NUMBER_OF_HASH_BUCKET_PIECES;
+	while (true) {
+		hash_directory_t* dir = __atomic_load_n(&ctx->dir, __ATOMIC_ACQUIRE);
+		uint8_t depth = __atomic_load_n(&dir->depth, __ATOMIC_ACQUIRE);
+		hash_bucket_t* b = hash_directory_bucket(ctx, dir, hash & (((uint64_t)1 << depth) - 1));
+
+		uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			_hash_cpu_relax();
+			continue;
+		}
+
+		bool found = false;
+		bool filtered = !_hash_bucket_filter_may_contain(b, key);
+		size_t chain = filtered ? 0 : NUMBER_OF_HASH_BUCKET_PIECES;
+		size_t scanned = 0;
+		// a torn depth gives a wrong key to look for, the seq check below catches it
+		uint8_t encoded_key[10];
+		uint8_t key_size = _hash_bucket_encode_key(ctx, b, key, hash, encoded_key);
+		for (size_t i = 0; i < chain; i++)
+		{
+			scanned++;
+			memcpy(&copy.piece, &b->pieces[(piece_idx + i) % NUMBER_OF_HASH_BUCKET_PIECES], sizeof(hash_bucket_piece_t));
+			uint8_t offset;
+			if (_hash_table_piece_find(ctx, &copy.piece, encoded_key, key_size, &offset)) {
+				uint8_t* buf = copy.piece.data + offset + key_size;
+				if (values && offset + key_size < PIECE_BUCKET_BUFFER_SIZE)
+					memcpy(values, buf, PIECE_BUCKET_BUFFER_SIZE - offset - key_size);
+				_hash_table_read_value(ctx, &buf, value);
+				found = true;
+				break;
+			}
+			if (!copy.piece.overflowed)
+				break;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		// the bucket may have been split (or merged) before we read its seq
+		dir = __atomic_load_n(&ctx->dir, __ATOMIC_ACQUIRE);
+		depth = __atomic_load_n(&dir->depth, __ATOMIC_ACQUIRE);
+		if (hash_directory_bucket(ctx, dir, hash & (((uint64_t)1 << depth) - 1)) != b)
+			continue;
+
+		_hash_table_count_get(ctx, scanned, filtered, found);
+		return found;
+	}
+}
+
+bool hash_table_get(hash_ctx_t* ctx, uint64_t key, uint64_t* value) {
+	if (ctx->concurrent) {
+		if (!hash_epoch_enter()) {
+			errno = EBUSY;
+			return false;
+		}
+		bool found = _hash_table_get_optimistic(ctx, key, _hash_table_hash(ctx, key), value, NULL);
+		hash_epoch_exit();
+		return found;
+	}
+
+	uint64_t hash = _hash_table_hash(ctx, key);
+	uint32_t bucket_idx = _hash_table_bucket_number(ctx, hash);
+	return _hash_table_get_from_bucket(ctx, hash_directory_bucket(ctx, ctx->dir, bucket_idx), key, hash, value);
+}
+
+size_t hash_table_get_batch(hash_ctx_t* ctx, const uint64_t* keys, size_t n, uint64_t* values, uint64_t* found_bitmap) {
+	// Software pipelined, each key goes through three stages HASH_BATCH_PREFETCH_DISTANCE
+	// iterations apart: prefetch the directory slot, then read the slot and prefetch the
+	// piece, then scan the piece. This way the misses of many keys are in flight at once.
+	// The stages run in reverse order, so the scan consumes its bucket before it is reused.
+	hash_bucket_t* buckets[HASH_BATCH_PREFETCH_DISTANCE];
+	uint64_t hashes[HASH_BATCH_PREFETCH_DISTANCE * 2];
+	size_t found = 0;
+
+	memset(found_bitmap, 0, ((n + 63) / 64) * sizeof(uint64_t));
+
+	if (ctx->concurrent && !hash_epoch_enter()) {
+		errno = EBUSY;
+		return 0;
+	}
+	hash_directory_t* dir = __atomic_load_n(&ctx->dir, __ATOMIC_ACQUIRE);
+	uint64_t mask = ((uint64_t)1 << __atomic_load_n(&dir->depth, __ATOMIC_ACQUIRE)) - 1;
+
+	if (ctx->prefetch_page) {
+		// the buckets may be on disk, the reads of the whole batch are started before any is waited for
+		for (size_t i = 0; i < n; i++)
+		{
+			uint64_t slot = _hash_table_hash(ctx, keys[i]) & mask;
+			hash_page_ref_t* segment = hash_directory_segment(ctx, dir, slot);
+			ctx->prefetch_page(ctx, hash_page_at(ctx, __atomic_load_n(&segment[slot & (HASH_DIRECTORY_SEGMENT_SLOTS - 1)], __ATOMIC_ACQUIRE)));
+		}
+	}
+
+	for (size_t i = 0; i < n + 2 * HASH_BATCH_PREFETCH_DISTANCE; i++)
+	{
+		if (i >= 2 * HASH_BATCH_PREFETCH_DISTANCE) {
+			size_t cur = i - 2 * HASH_BATCH_PREFETCH_DISTANCE;
+			bool exists;
+			if (ctx->concurrent) {
+				// the prefetched bucket is only a hint here, the lookup validates on its own
+				exists = _hash_table_get_optimistic(ctx, keys[cur], hashes[cur % (HASH_BATCH_PREFETCH_DISTANCE * 2)], &values[cur], NULL);
+			}
+			else {
+				exists = _hash_table_get_from_bucket(ctx, buckets[cur % HASH_BATCH_PREFETCH_DISTANCE], keys[cur], hashes[cur % (HASH_BATCH_PREFETCH_DISTANCE * 2)], &values[cur]);
+			}
+			if (exists) {
+				found_bitmap[cur / 64] |= (uint64_t)1 << (cur % 64);
+				found++;
+			}
+		}
+		if (i >= HASH_BATCH_PREFETCH_DISTANCE && i - HASH_BATCH_PREFETCH_DISTANCE < n) {
+			size_t cur = i - HASH_BATCH_PREFETCH_DISTANCE;
+			uint64_t hash = hashes[cur % (HASH_BATCH_PREFETCH_DISTANCE * 2)];
+			hash_bucket_t* b = hash_directory_bucket(ctx, dir, hash & mask);
+			buckets[cur % HASH_BATCH_PREFETCH_DISTANCE] = b;
+#if HASH_BUCKET_FILTER_LINES
+			__builtin_prefetch(_hash_bucket_filter_line(b, _hash_bucket_filter_hash(keys[cur])));
+#endif
+			__builtin_prefetch(&b->pieces[hash % NUMBER_OF_HASH_BUCKET_PIECES]);
+		}
+		if (i < n) {
+			// the hash of a key is kept until its scan, two distances later
+			uint64_t slot = (hashes[i % (HASH_BATCH_PREFETCH_DISTANCE * 2)] = _hash_table_hash(ctx, keys[i])) & mask;
+			__builtin_prefetch(&hash_directory_segment(ctx, dir, slot)[slot & (HASH_DIRECTORY_SEGMENT_SLOTS - 1)]);
+		}
+	}
+
+	if (ctx->concurrent)
+		hash_epoch_exit();
+	return found;
 }
 
 static bool _hash_table_piece_append_kv(hash_bucket_t* cur, uint32_t piece_idx, uint8_t* buffer, uint8_t size) {
@@ -110,8 +913,9 @@ static void _validate_bucket(hash_ctx_t* ctx, hash_bucket_t* tmp) {
 		while (buf < end)
 		{
 			uint64_t k, v;
-			varint_decode(&buf, &k);
-			varint_decode(&buf, &v);
+			_hash_table_read_key(ctx, &buf, &k);
+			_hash_table_read_value(ctx, &buf, &v);
+			k = _hash_table_hash(ctx, _hash_bucket_entry_key(ctx, tmp, k));
 
 			if (has_first == false)
 			{
@@ -125,121 +929,256 @@ static void _validate_bucket(hash_ctx_t* ctx, hash_bucket_t* tmp) {
 			}
 		}
 	}
+#else
+	(void)ctx;
+	(void)tmp;
 #endif
 }
 
 
-static bool _hash_table_put_increase_size(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t key, uint64_t value, uint8_t* buffer, uint8_t encoded_size) {
+// moves the entries of b that have bit set to the same piece in n. Every entry stays at the
+// piece it was in, so the chains are as valid as before and nothing can fail to fit, only the
+// overflowed marks are recomputed for each side. A piece that goes entirely to one side is
+// left alone or copied as a whole. b and n already have their new depth, with compress_keys the
+// stored keys lose a bit, which can only make them shorter, returns the bytes that saved.
+// a set's entry can be a single byte, so a piece holds up to PIECE_BUCKET_BUFFER_SIZE entries
+static_assert(PIECE_BUCKET_BUFFER_SIZE <= 64, "the moves of a piece's entries must fit in 64 bits");
 
-	if (ctx->dir->depth == b->depth) {
-		hash_directory_t* new_dir;
-		if ((size_t)ctx->dir->number_of_buckets * 2 * sizeof(hash_bucket_t*) > _hash_table_get_directory_capacity(ctx)) {
+static uint64_t _hash_table_split_pieces(hash_ctx_t* ctx, hash_bucket_t* b, hash_bucket_t* n, uint64_t bit) {
+	bool b_overflowed[NUMBER_OF_HASH_BUCKET_PIECES] = { 0 };
+	bool n_overflowed[NUMBER_OF_HASH_BUCKET_PIECES] = { 0 };
+	uint64_t moved_entries = 0;
+	uint64_t saved = 0;
 
-			// have to increase the actual allocated memory here
-			new_dir = ctx->allocate_page(ctx->dir->directory_pages * 2);
-			if (new_dir == NULL)
-				return false;
+	// both filters are built from scratch, which also drops the deleted keys from b's
+	memset(b->filter, 0, sizeof(b->filter));
+	b->filter_deletes = 0;
 
-			size_t dir_size = (size_t)ctx->dir->directory_pages * HASH_BUCKET_PAGE_SIZE;
-			memcpy(new_dir, ctx->dir, dir_size);
-			new_dir->directory_pages *= 2;
+	for (uint32_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++)
+	{
+		hash_bucket_piece_t* src = &b->pieces[i];
+		uint8_t* buf = src->data;
+		uint8_t* end = buf + src->bytes_used;
+		uint64_t moves = 0; // a bit per entry, at most PIECE_BUCKET_BUFFER_SIZE of them
+		uint32_t entries = 0;
+		while (buf < end)
+		{
+			uint64_t k, v;
+			_hash_table_read_key(ctx, &buf, &k);
+			_hash_table_read_value(ctx, &buf, &v);
+			// the stored key is still in the form of the old depth
+			uint64_t hash = ctx->compress_keys ? (k << (b->depth - 1)) | b->prefix : _hash_table_hash(ctx, k);
+			bool move = (hash & bit) != 0;
+			moves |= (uint64_t)move << entries++;
+			_hash_bucket_filter_add(move ? n : b, ctx->compress_keys ? hash_key_unmix(ctx->mix, hash) : k);
+			// an entry away from its own piece needs the pieces before it marked as overflowed
+			bool* overflowed = move ? n_overflowed : b_overflowed;
+			for (uint32_t h = hash % NUMBER_OF_HASH_BUCKET_PIECES; h != i; h = (h + 1) % NUMBER_OF_HASH_BUCKET_PIECES)
+				overflowed[h] = true;
 		}
-		else {
-			new_dir = ctx->dir; // there is enough space to increase size without allocations
+		if (!moves && !ctx->compress_keys)
+			continue;
+
+		hash_bucket_piece_t* dst = &n->pieces[i];
+		moved_entries += __builtin_popcountll(moves);
+		if (moves == ((uint64_t)1 << entries) - 1 && !ctx->compress_keys) {
+			memcpy(dst, src, sizeof(hash_bucket_piece_t));
+			src->bytes_used = 0;
+			continue;
 		}
-		size_t buckets_size = ctx->dir->number_of_buckets * sizeof(hash_bucket_t*);
-		memcpy((uint8_t*)new_dir->buckets + buckets_size, (uint8_t*)ctx->dir->buckets, buckets_size);
-		new_dir->depth++;
-		new_dir->number_of_buckets *= 2;
-		if (new_dir != ctx->dir) {
-			ctx->release_page(ctx->dir);
-			ctx->dir = new_dir;
+
+		uint8_t* keep = src->data;
+		buf = src->data;
+		for (uint32_t e = 0; e < entries; e++)
+		{
+			uint8_t* start = buf;
+			uint64_t k, v;
+			_hash_table_read_key(ctx, &buf, &k);
+			uint8_t* value = buf;
+			_hash_table_read_value(ctx, &buf, &v);
+			bool move = (moves & ((uint64_t)1 << e)) != 0;
+			uint8_t* to = move ? dst->data + dst->bytes_used : keep;
+			if (ctx->compress_keys) {
+				// never longer than before, so writing over our own entry is safe
+				uint8_t* at = to;
+				_hash_table_write_key(ctx, k >> 1, &to);
+				memmove(to, value, buf - value);
+				to += buf - value;
+				saved += (buf - start) - (to - at);
+			}
+			else {
+				memmove(to, start, buf - start);
+				to += buf - start;
+			}
+			if (move)
+				dst->bytes_used = (uint8_t)(to - dst->data);
+			else
+				keep = to;
 		}
+		src->bytes_used = (uint8_t)(keep - src->data);
 	}
-	//write_dir_graphviz(ctx, "BEFORE");
-	hash_bucket_t* n = _create_hash_bucket(ctx);
-	if (!n)
-		return false;
 
-	hash_bucket_t* tmp = ctx->allocate_page(1);
-	if (!tmp) {
-		ctx->release_page(n);
-		ctx->release_page(tmp);
-		// no need to release the ctx->dir we allocated, was wired
-		// properly to the table and will be freed with the whole table
-		return false;
+	for (uint32_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++)
+	{
+		b->pieces[i].overflowed = b_overflowed[i];
+		n->pieces[i].overflowed = n_overflowed[i];
 	}
-	memcpy(tmp, b, HASH_BUCKET_PAGE_SIZE);
-	memset(b, 0, sizeof(hash_bucket_t));
-	memset(n, 0, sizeof(hash_bucket_t));
-	n->depth = b->depth = tmp->depth + 1;
+	n->number_of_entries = moved_entries;
+	b->number_of_entries -= moved_entries;
+	return saved;
+}
 
-	uint32_t bit = 1 << tmp->depth;
+// gives segment s a page of its own, a copy of the segment it was reading as
+static bool _hash_table_materialize_segment(hash_ctx_t* ctx, size_t s) {
+	hash_page_ref_t* segment = _hash_table_allocate_pages(ctx, 1);
+	if (!segment)
+		return false;
+	memcpy(segment, hash_directory_segment(ctx, ctx->dir, (uint64_t)s << HASH_DIRECTORY_SEGMENT_BITS), HASH_BUCKET_PAGE_SIZE);
+	__atomic_store_n(&ctx->dir->segments[s], hash_page_ref(ctx, segment), __ATOMIC_RELEASE);
+	ctx->dir->segment_pages++;
+	_hash_table_set_segment_generation(ctx, s);
+	return true;
+}
 
-#if VALIDATE
-	uint64_t mask = (bit >> 1) - 1;
-	bool has_first = false;
-	uint64_t first_key = 0;
-#endif
+// A missing segment reads the same as the one it stands for, the slots that were first modulo
+// step are about to differ at bit between the two if that is one of the bits between their
+// indexes, so those segments get their own copy first, while the slots still hold what they did
+static bool _hash_table_materialize_segments(hash_ctx_t* ctx, uint64_t first, uint64_t step, uint64_t bit) {
+	if (bit < HASH_DIRECTORY_SEGMENT_SLOTS)
+		return true; // the bits of the segment index are all above it
+	for (uint64_t i = first; i < ctx->dir->number_of_buckets; i += step)
+	{
+		size_t s = i >> HASH_DIRECTORY_SEGMENT_BITS, from = s;
+		while (!ctx->dir->segments[from])
+			from &= ~((size_t)1 << (63 - __builtin_clzll(from)));
+		if (((((uint64_t)(s ^ from)) << HASH_DIRECTORY_SEGMENT_BITS) & bit) && !_hash_table_materialize_segment(ctx, s))
+			return false;
+	}
+	return true;
+}
 
-	for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++)
+// points the slots that are first modulo step at low, or at high those of them that have bit set
+// (0 for none). The missing segments are skipped, they read as the ones written here.
+static void _hash_table_set_slots(hash_ctx_t* ctx, uint64_t first, uint64_t step, uint64_t bit, hash_bucket_t* low, hash_bucket_t* high) {
+	size_t segments = _hash_table_segments_for(ctx->dir->number_of_buckets);
+	uint64_t slots = ctx->dir->number_of_buckets < HASH_DIRECTORY_SEGMENT_SLOTS ? ctx->dir->number_of_buckets : HASH_DIRECTORY_SEGMENT_SLOTS;
+	size_t segment_step = step > HASH_DIRECTORY_SEGMENT_SLOTS ? step >> HASH_DIRECTORY_SEGMENT_BITS : 1;
+	for (size_t s = first >> HASH_DIRECTORY_SEGMENT_BITS; s < segments; s += segment_step)
 	{
-		uint8_t* buf = tmp->pieces[i].data;
-		uint8_t* end = buf + tmp->pieces[i].bytes_used;
-		while (buf < end)
+		if (!ctx->dir->segments[s])
+			continue;
+		hash_page_ref_t* segment = (hash_page_ref_t*)hash_page_at(ctx, ctx->dir->segments[s]);
+		for (uint64_t j = first & (HASH_DIRECTORY_SEGMENT_SLOTS - 1); j < slots; j += step)
 		{
-			uint64_t k, v;
-			uint8_t* start = buf;
-			varint_decode(&buf, &k);
-			varint_decode(&buf, &v);
-#if VALIDATE
-			if (!has_first) {
-				first_key = k;
-				has_first = true;
-			}
-
-			if ((first_key & mask) != (k & mask)) {
-				printf("mistmatch!: %I64u != %I64u\n", first_key, k);
-			}
-#endif
-
-			hash_bucket_t* cur = k & bit ? n : b;
-			bool success = _hash_table_piece_append_kv(cur, k % NUMBER_OF_HASH_BUCKET_PIECES, start, (uint8_t)(buf - start));
-#if VALIDATE
-			if (!success)
-				printf("Can't split a page properly? Impossible");
-#endif
+			uint64_t i = ((uint64_t)s << HASH_DIRECTORY_SEGMENT_BITS) + j;
+			__atomic_store_n(&segment[j], hash_page_ref(ctx, (i & bit) ? high : low), __ATOMIC_RELEASE);
 		}
 	}
-	ctx->release_page(tmp);
+}
 
-	for (size_t i = key & (bit - 1); i < ctx->dir->number_of_buckets; i += bit)
-	{
-		ctx->dir->buckets[i] = i & bit ? n : b;
+// b is the bucket of hash, returns the copy of it the table now has if a snapshot has b, or b.
+// Readers that were in b see the slots change and retry in the copy, b is left as it was.
+static hash_bucket_t* _hash_table_unshare_bucket(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t hash) {
+	if (!_hash_table_is_shared(ctx, b->generation))
+		return b;
+	uint64_t step = (uint64_t)1 << b->depth;
+	if (!_hash_table_unshare_segments(ctx, hash & (step - 1), step))
+		return NULL;
+	hash_bucket_t* copy = _hash_table_allocate_pages(ctx, 1);
+	if (!copy)
+		return NULL;
+	memcpy(copy, b, sizeof(hash_bucket_t));
+	copy->generation = ctx->dir->generation;
+	_hash_table_set_slots(ctx, hash & (step - 1), step, 0, copy, copy);
+	_hash_table_release_page(ctx, b, 1, b->generation);
+	return copy;
+}
+
+// remembers the bucket of hash for hash_table_maintenance, false if there is no memory to,
+// the delete then compacts on the spot and a split fails
+static bool _hash_table_defer_compaction(hash_ctx_t* ctx, uint64_t hash) {
+	if (ctx->compaction_count == ctx->compaction_capacity) {
+		uint32_t capacity = ctx->compaction_capacity ? ctx->compaction_capacity * 2 : 64;
+		uint64_t* candidates = realloc(ctx->compaction_candidates, capacity * sizeof(uint64_t));
+		if (!candidates)
+			return false;
+		ctx->compaction_candidates = candidates;
+		ctx->compaction_capacity = capacity;
 	}
+	ctx->compaction_candidates[ctx->compaction_count++] = hash;
+	return true;
+}
 
-	// now can add the new value in...
-	{
-		hash_bucket_t* cur = key & bit ? n : b;
-		if (_hash_table_piece_append_kv(cur, key % NUMBER_OF_HASH_BUCKET_PIECES, buffer, encoded_size)) {
-			ctx->dir->number_of_entries++;
+// splits b in two, growing the directory if b is already as deep as it, b is being written to.
+// Growing copies half a segment at most, past the first segment the new ones are left missing.
+static bool _hash_table_put_increase_size(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t hash) {
+
+	if (b->depth >= HASH_DIRECTORY_MAX_DEPTH) { // its keys all share the low HASH_DIRECTORY_MAX_DEPTH bits of their hash
+		errno = ENOSPC;
+		return false;
+	}
+	// the emptied pieces may end up in either half, so both are queued for hash_table_maintenance
+	uint64_t bit = (uint64_t)1 << b->depth;
+	if (b->compaction_pending && (!_hash_table_defer_compaction(ctx, hash & (bit - 1)) ||
+		!_hash_table_defer_compaction(ctx, (hash & (bit - 1)) | bit))) {
+		errno = ENOMEM;
+		return false;
+	}
+	if (ctx->dir->depth == b->depth) {
+		hash_directory_t* new_dir = ctx->dir;
+		if (ctx->dir->number_of_buckets < HASH_DIRECTORY_SEGMENT_SLOTS) {
+			if (!_hash_table_unshare_segment(ctx, 0))
+				return false;
+			hash_page_ref_t* segment = (hash_page_ref_t*)hash_page_at(ctx, ctx->dir->segments[0]);
+			memcpy(segment + ctx->dir->number_of_buckets, segment, ctx->dir->number_of_buckets * sizeof(hash_page_ref_t));
 		}
-		else {
-			if (!hash_table_put(ctx, key, value)) {
-#if VALIDATE
-				printf("Unable to recursively add? That really should never happen.");
-#endif
+		else if (_hash_table_segments_for((size_t)ctx->dir->number_of_buckets * 2) > _hash_table_get_directory_capacity(ctx->dir)) {
+			// have to increase the actual allocated memory here, the segments themselves are shared
+			new_dir = _hash_table_allocate_pages(ctx, ctx->dir->directory_pages * 2);
+			if (new_dir == NULL)
 				return false;
-			}
+
+			size_t dir_size = (size_t)ctx->dir->directory_pages * HASH_BUCKET_PAGE_SIZE;
+			memcpy(new_dir, ctx->dir, dir_size);
+			memset((uint8_t*)new_dir + dir_size, 0, dir_size);
+			new_dir->directory_pages *= 2;
+		}
+		// readers pick the slots by depth, so the upper half must be there before it grows
+		__atomic_store_n(&new_dir->depth, new_dir->depth + 1, __ATOMIC_RELEASE);
+		new_dir->number_of_buckets *= 2;
+		if (new_dir != ctx->dir) {
+			hash_directory_t* old_dir = ctx->dir;
+			__atomic_store_n(&ctx->dir, new_dir, __ATOMIC_RELEASE);
+			_hash_table_release_page(ctx, old_dir, old_dir->directory_pages, old_dir->generation);
 		}
+		HASH_STAT_ADD(ctx, directory_doublings, 1);
+	}
+	hash_bucket_t* n = _create_hash_bucket(ctx);
+	if (!n)
+		return false;
+	if (!_hash_table_materialize_segments(ctx, hash & (bit - 1), bit, bit) ||
+		!_hash_table_unshare_segments(ctx, hash & (bit - 1), bit)) {
+		_hash_table_free_pages(ctx, n, 1);
+		return false;
 	}
 
+	ctx->dir->buckets_at_depth[b->depth]--;
+	n->depth = b->depth = b->depth + 1;
+	ctx->dir->buckets_at_depth[b->depth] += 2;
+	n->prefix = b->prefix | (uint32_t)bit;
+	n->compaction_pending = b->compaction_pending;
+	ctx->dir->bytes_used -= _hash_table_split_pieces(ctx, b, n, bit);
+	_hash_table_set_slots(ctx, hash & (bit - 1), bit, bit, b, n);
+
 	_validate_bucket(ctx, n);
 	_validate_bucket(ctx, b);
+	ctx->dir->number_of_bucket_pages++;
+	HASH_STAT_ADD(ctx, splits, 1);
 	return true;
 }
 
 static bool _hash_table_overflow_merge(hash_ctx_t* ctx, hash_bucket_t* b, uint32_t piece_idx) {
+	HASH_STAT_ADD(ctx, overflow_merges, 1);
 	size_t max_overflow = 0;
 	for (size_t j = 0; j < NUMBER_OF_HASH_BUCKET_PIECES; j++) {
 		if (!b->pieces[(piece_idx + j) % NUMBER_OF_HASH_BUCKET_PIECES].overflowed) {
@@ -260,9 +1199,9 @@ static bool _hash_table_overflow_merge(hash_ctx_t* ctx, hash_bucket_t* b, uint32
 		uint8_t* end = buf + cur->bytes_used;
 		while (buf < end) {
 			uint8_t* cur_buf_start = buf;
-			varint_decode(&buf, &k);
-			varint_decode(&buf, &v);
-			uint32_t key_piece_idx = k % NUMBER_OF_HASH_BUCKET_PIECES;
+			_hash_table_read_key(ctx, &buf, &k);
+			_hash_table_read_value(ctx, &buf, &v);
+			uint32_t key_piece_idx = _hash_bucket_entry_hash(ctx, b, k) % NUMBER_OF_HASH_BUCKET_PIECES;
 			if (key_piece_idx != cur_piece_idx) {
 				// great, found something that we can move backward
 				ptrdiff_t diff = buf - cur_buf_start;
@@ -282,7 +1221,7 @@ static bool _hash_table_overflow_merge(hash_ctx_t* ctx, hash_bucket_t* b, uint32
 			}
 		}
 		if (!has_overflow) {
-			uint32_t prev_idx = cur_piece_idx ? cur_piece_idx - 1 : NUMBER_OF_HASH_BUCKET_PIECES;
+			uint32_t prev_idx = cur_piece_idx ? cur_piece_idx - 1 : NUMBER_OF_HASH_BUCKET_PIECES - 1;
 			hash_bucket_piece_t* prev = &b->pieces[prev_idx];
 			prev->overflowed = false;
 		}
@@ -292,271 +1231,1020 @@ static bool _hash_table_overflow_merge(hash_ctx_t* ctx, hash_bucket_t* b, uint32
 	return b->pieces[piece_idx].overflowed || b->pieces[piece_idx].bytes_used > 0;
 }
 
-static size_t _get_bucket_size(hash_bucket_t* b) {
-	size_t total = NUMBER_OF_HASH_BUCKET_PIECES * (sizeof(hash_bucket_piece_t) - PIECE_BUCKET_BUFFER_SIZE);
-	for (size_t j = 0; j < NUMBER_OF_HASH_BUCKET_PIECES; j++) {
-		total += b->pieces[j].bytes_used;
+static size_t _get_bucket_size(hash_bucket_t* b) {
+	size_t total = NUMBER_OF_HASH_BUCKET_PIECES * (sizeof(hash_bucket_piece_t) - PIECE_BUCKET_BUFFER_SIZE);
+	for (size_t j = 0; j < NUMBER_OF_HASH_BUCKET_PIECES; j++) {
+		total += b->pieces[j].bytes_used;
+	}
+	return total;
+}
+
+static bool _hash_bucket_copy(hash_ctx_t* ctx, hash_bucket_t* dst, hash_bucket_t* src) {
+	for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++)
+	{
+		uint8_t* buf = src->pieces[i].data;
+		uint8_t* end = buf + src->pieces[i].bytes_used;
+		while (buf < end)
+		{
+			uint64_t k, v;
+			uint8_t* start = buf;
+			_hash_table_read_key(ctx, &buf, &k);
+			uint8_t* value = buf;
+			_hash_table_read_value(ctx, &buf, &v);
+			uint64_t hash = _hash_bucket_entry_hash(ctx, src, k);
+			uint64_t key = _hash_bucket_entry_key(ctx, src, k);
+			uint8_t entry[PIECE_BUCKET_BUFFER_SIZE];
+			uint8_t size = (uint8_t)(buf - start);
+			if (ctx->compress_keys) {
+				// dst is shallower, the key takes back the bit that told the siblings apart
+				size = _hash_bucket_encode_key(ctx, dst, key, hash, entry);
+				memcpy(entry + size, value, buf - value);
+				size += (uint8_t)(buf - value);
+				start = entry;
+			}
+			if (!_hash_table_piece_append_kv(dst, hash % NUMBER_OF_HASH_BUCKET_PIECES, start, size)) {
+				return false;
+			}
+			_hash_bucket_filter_add(dst, key);
+		}
+	}
+	return true;
+}
+
+// merges the bucket at bucket_idx with its sibling if the two fit in one, returns whether it did
+static bool _hash_table_compact_pages(hash_ctx_t* ctx, uint64_t hash, uint32_t bucket_idx) {
+	if (ctx->dir->number_of_buckets <= 2)
+		return false; // can't compact if we have just 2 pages
+	hash_bucket_t* left = hash_directory_bucket(ctx, ctx->dir, bucket_idx);
+	if (left->depth <= 1)
+		return false; // the table always has at least 2 buckets
+	uint32_t sibling_idx = bucket_idx ^ ((uint64_t)1 << (left->depth - 1));
+	hash_bucket_t* right = hash_directory_bucket(ctx, ctx->dir, sibling_idx);
+	if (right->depth != left->depth)
+		return false; // the sibling was split further, merging would orphan its own siblings
+	if (_get_bucket_size(right) + _get_bucket_size(left) > HASH_BUCKET_PAGE_SIZE_MERGE_LIMIT)
+		return false; // too big for compaction, we'll try again later
+
+	hash_bucket_t* merged = _create_hash_bucket(ctx);
+	// we couldn't merge, out of mem, but that is fine, we don't *have* to
+	if (!merged)
+		return false;
+
+	merged->depth = left->depth < right->depth ? left->depth : right->depth;
+	merged->depth--;
+	merged->prefix = left->prefix & (((uint64_t)1 << merged->depth) - 1);
+	if (!_hash_bucket_copy(ctx, merged, left) || !_hash_bucket_copy(ctx, merged, right)) {
+		// failed to copy, sad, but we'll try again later
+		_hash_table_free_pages(ctx, merged, 1);
+		return false;
+	}
+	_validate_bucket(ctx, merged);
+	uint64_t bit = (uint64_t)1 << merged->depth;
+	if (!_hash_table_unshare_segments(ctx, hash & (bit - 1), bit)) {
+		_hash_table_free_pages(ctx, merged, 1);
+		return false;
+	}
+	// the stored keys grew back by the bit the split took away from them
+	ctx->dir->bytes_used += _get_bucket_size(merged) - _get_bucket_size(left) - _get_bucket_size(right) +
+		NUMBER_OF_HASH_BUCKET_PIECES * (sizeof(hash_bucket_piece_t) - PIECE_BUCKET_BUFFER_SIZE);
+
+	// a missing segment only ever stood for slots of the same bucket, so none need a copy here
+	_hash_table_set_slots(ctx, hash & (bit - 1), bit, 0, merged, merged);
+	_hash_table_release_page(ctx, right, 1, right->generation);
+	_hash_table_release_page(ctx, left, 1, left->generation);
+	ctx->dir->buckets_at_depth[merged->depth + 1] -= 2;
+	ctx->dir->buckets_at_depth[merged->depth]++;
+	ctx->dir->number_of_bucket_pages--;
+	HASH_STAT_ADD(ctx, page_merges, 1);
+
+	if (ctx->dir->buckets_at_depth[ctx->dir->depth])
+		return true; // some bucket still needs every bit of the directory
+
+	// no bucket is as deep as the directory, its upper half is the same as the lower, so it
+	// can go, and as long as that holds for the shallower depths, their upper halves too
+	size_t segments;
+	do
+	{
+		__atomic_store_n(&ctx->dir->depth, ctx->dir->depth - 1, __ATOMIC_RELEASE);
+		ctx->dir->number_of_buckets /= 2;
+		HASH_STAT_ADD(ctx, directory_shrinks, 1);
+
+		segments = _hash_table_segments_for(ctx->dir->number_of_buckets);
+		for (size_t s = segments; s < _hash_table_segments_for((size_t)ctx->dir->number_of_buckets * 2); s++)
+		{
+			if (!ctx->dir->segments[s])
+				continue;
+			void* segment = hash_page_at(ctx, ctx->dir->segments[s]);
+			__atomic_store_n(&ctx->dir->segments[s], 0, __ATOMIC_RELEASE);
+			_hash_table_release_page(ctx, segment, 1, _hash_table_segment_generation(ctx, s));
+			ctx->dir->segment_pages--;
+		}
+	} while (ctx->dir->depth > 1 && !ctx->dir->buckets_at_depth[ctx->dir->depth]);
+
+	if (ctx->dir->directory_pages == 1 ||
+		segments * 2 >= _hash_table_get_directory_capacity(ctx->dir))
+		return true; // we are using more than half the space, nothing to touch here
+
+	hash_directory_t* new_dir = _hash_table_allocate_pages(ctx, ctx->dir->directory_pages / 2);
+	if (new_dir != NULL) { // if we can't allocate, just ignore this, it is fine
+		size_t dir_size = (size_t)(ctx->dir->directory_pages / 2) * HASH_BUCKET_PAGE_SIZE;
+		memcpy(new_dir, ctx->dir, dir_size);
+		new_dir->directory_pages /= 2;
+		hash_directory_t* old_dir = ctx->dir;
+		__atomic_store_n(&ctx->dir, new_dir, __ATOMIC_RELEASE);
+		_hash_table_release_page(ctx, old_dir, old_dir->directory_pages, old_dir->generation);
+	}
+	return true;
+}
+
+// the pages of a table loaded by hash_table_load_mmap can't be written, nor new ones allocated
+static inline bool _hash_table_writable(hash_ctx_t* ctx) {
+	if (ctx->read_only) {
+		errno = EROFS;
+		return false;
+	}
+	return true;
+}
+
+size_t hash_table_maintenance(hash_ctx_t* ctx, size_t budget) {
+	if (!_hash_table_writable(ctx))
+		return 0; // nothing is ever pending
+	for (; budget && ctx->compaction_count; budget--)
+	{
+		uint64_t hash = ctx->compaction_candidates[ctx->compaction_count - 1];
+		if (!_hash_table_unshare_directory(ctx))
+			break;
+		uint32_t bucket_idx = _hash_table_bucket_number(ctx, hash);
+		hash_bucket_t* b = hash_directory_bucket(ctx, ctx->dir, bucket_idx);
+		// a bucket merged since is a new one, it isn't marked
+		if (b->compaction_pending) {
+			if (!(b = _hash_table_unshare_bucket(ctx, b, hash)))
+				break;
+			ctx->dir->version++;
+			_hash_bucket_write_begin(ctx, b);
+			b->compaction_pending = false;
+			// pull the chains that go through the emptied pieces back, then see if the
+			// bucket and its sibling fit in one
+			for (uint32_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++)
+			{
+				if (!b->pieces[i].bytes_used && b->pieces[i].overflowed)
+					_hash_table_overflow_merge(ctx, b, i);
+			}
+			_hash_bucket_write_end(ctx, b);
+			// the deletes are all done by now, so the merged bucket may well fit with its own sibling
+			while (_hash_table_compact_pages(ctx, hash, bucket_idx))
+				bucket_idx = _hash_table_bucket_number(ctx, hash);
+		}
+		ctx->compaction_count--;
+	}
+	if (ctx->evict_pages)
+		ctx->evict_pages(ctx, true);
+	return ctx->compaction_count;
+}
+
+// hands a change that was made to the write-ahead log, if the table has one
+static inline bool _hash_table_log(hash_ctx_t* ctx, hash_change_t change, uint64_t key, uint64_t value) {
+	// the writer pays for the pages the readers pushed past the cache limit
+	if (ctx->evict_pages)
+		ctx->evict_pages(ctx, false);
+	return !ctx->log_change || ctx->log_change(ctx, change, key, value);
+}
+
+bool hash_table_delete(hash_ctx_t* ctx, uint64_t key, hash_old_value_t* old_value) {
+	if (old_value)
+		old_value->exists = false;
+	if (!_hash_table_writable(ctx))
+		return false;
+
+	uint64_t hash = _hash_table_hash(ctx, key);
+	uint32_t bucket_idx = _hash_table_bucket_number(ctx, hash);
+	hash_bucket_t* b = hash_directory_bucket(ctx, ctx->dir, bucket_idx);
+	uint32_t piece_idx = hash % NUMBER_OF_HASH_BUCKET_PIECES;
+
+	// a missing key changes nothing, so nothing a snapshot shares is copied for it
+	if (!_hash_bucket_filter_may_contain(b, key))
+		return false;
+	uint8_t encoded_key[10];
+	uint8_t key_size = _hash_bucket_encode_key(ctx, b, key, hash, encoded_key);
+	uint8_t* cur_buf_start;
+	size_t scanned;
+	hash_bucket_piece_t* p = _hash_table_find_entry(ctx, b, piece_idx, encoded_key, key_size, &cur_buf_start, &scanned);
+	if (!p)
+		return false;
+	// the buckets stay where they are when the directory is copied
+	if (!_hash_table_unshare_directory(ctx))
+		return false;
+	ctx->dir->version++;
+	HASH_STAT_ADD(ctx, deletes, 1);
+
+	hash_bucket_t* copy = _hash_table_unshare_bucket(ctx, b, hash);
+	if (!copy)
+		return false;
+	if (copy != b) {
+		// the entry is at the same place in the copy
+		p = (hash_bucket_piece_t*)((uint8_t*)copy + ((uint8_t*)p - (uint8_t*)b));
+		cur_buf_start = (uint8_t*)copy + (cur_buf_start - (uint8_t*)b);
+		b = copy;
+	}
+
+	uint64_t v;
+	uint8_t* buf = cur_buf_start + key_size;
+	_hash_table_read_value(ctx, &buf, &v);
+	if (old_value) {
+		old_value->exists = true;
+		old_value->value = v;
+	}
+
+	ptrdiff_t diff = buf - cur_buf_start;
+	_hash_bucket_write_begin(ctx, b);
+	if (ctx->layout == HASH_LAYOUT_MULTIMAP)
+		_hash_multimap_release_run(ctx, cur_buf_start + key_size, true);
+	memmove(cur_buf_start, buf, p->data + p->bytes_used - buf);
+	p->bytes_used -= (uint8_t)diff;
+	b->number_of_entries--;
+	ctx->dir->number_of_entries--;
+	ctx->dir->bytes_used -= diff;
+	// once a quarter of what the filter holds is gone, it is worth building it again
+	if (++b->filter_deletes > b->number_of_entries / 4)
+		_hash_bucket_filter_rebuild(ctx, b);
+
+	bool compact = false;
+	if (p->bytes_used == 0) {
+		if (ctx->deferred_compaction && (b->compaction_pending || _hash_table_defer_compaction(ctx, hash)))
+			b->compaction_pending = true;
+		else
+			compact = !_hash_table_overflow_merge(ctx, b, (uint32_t)(p - b->pieces));
+	}
+	_hash_bucket_write_end(ctx, b);
+	if (compact)
+		_hash_table_compact_pages(ctx, hash, bucket_idx);
+
+	return _hash_table_log(ctx, HASH_CHANGE_DELETE, key, 0);
+}
+
+bool hash_table_put(hash_ctx_t* ctx, uint64_t key, uint64_t value) {
+	return hash_table_replace(ctx, key, value, NULL);
+}
+
+bool hash_set_add(hash_ctx_t* ctx, uint64_t key) {
+	return hash_table_replace(ctx, key, 0, NULL);
+}
+
+bool hash_set_contains(hash_ctx_t* ctx, uint64_t key) {
+	uint64_t value;
+	return hash_table_get(ctx, key, &value);
+}
+
+bool hash_set_remove(hash_ctx_t* ctx, uint64_t key) {
+	errno = 0;
+	return hash_table_delete(ctx, key, NULL);
+}
+
+static bool _hash_table_append_entry(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t key, uint64_t hash, uint8_t* buffer, uint8_t encoded_size) {
+	uint32_t piece_idx = hash % NUMBER_OF_HASH_BUCKET_PIECES;
+	for (size_t i = 0; i < MAX_CHAIN_LENGTH; i++) {
+		hash_bucket_piece_t* p = &b->pieces[(piece_idx + i) % NUMBER_OF_HASH_BUCKET_PIECES];
+		if (p->bytes_used + encoded_size <= PIECE_BUCKET_BUFFER_SIZE) {
+			memcpy(p->data + p->bytes_used, buffer, encoded_size);
+			p->bytes_used += encoded_size;
+			b->number_of_entries++;
+			ctx->dir->number_of_entries++;
+			ctx->dir->bytes_used += encoded_size;
+			_hash_bucket_filter_add(b, key);
+			return true;
+		}
+		p->overflowed = true;
+	}
+	return false;
+}
+
+// replaces the entry of key in p, size bytes at entry, with the encoded_size ones in buffer.
+// Returns false if there is no room for them in b, in which case b is left as it was.
+static bool _hash_table_rewrite_entry(hash_ctx_t* ctx, hash_bucket_t* b, hash_bucket_piece_t* p, uint8_t* entry, uint8_t size, uint64_t key, uint64_t hash, uint8_t* buffer, uint8_t encoded_size) {
+	if (size == encoded_size) {
+		// new value fit exactly where the old one went, let's put it there
+		memcpy(entry, buffer, encoded_size);
+		_validate_bucket(ctx, b);
+		return true;
+	}
+
+	uint8_t old_entry[PIECE_BUCKET_BUFFER_SIZE];
+	memcpy(old_entry, entry, size);
+	memmove(entry, entry + size, p->data + p->bytes_used - (entry + size));
+	p->bytes_used -= size;
+	b->number_of_entries--;
+	ctx->dir->number_of_entries--;
+	ctx->dir->bytes_used -= size;
+
+	if (_hash_table_append_entry(ctx, b, key, hash, buffer, encoded_size)) {
+		_validate_bucket(ctx, b);
+		return true;
+	}
+
+	// no room for the new size, put the old entry back (there is room for it in its piece) so
+	// the key never goes missing, and let the caller split the bucket
+	memcpy(p->data + p->bytes_used, old_entry, size);
+	p->bytes_used += size;
+	b->number_of_entries++;
+	ctx->dir->number_of_entries++;
+	ctx->dir->bytes_used += size;
+	return false;
+}
+
+// tmp_buffer holds the encoded key, the value goes after it. With merge the value is computed
+// from the stored one and returned in value. Returns false if there is no room for the entry
+// in b, or the merged value doesn't fit the layout, in which case b is left as it was.
+static bool _hash_table_replace_in_bucket(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t key, uint64_t hash, uint8_t* tmp_buffer, uint8_t key_size, uint64_t* value, hash_merge_fn_t merge, void* arg, hash_old_value_t* old_value) {
+	uint8_t* cur_buf_start;
+	size_t scanned;
+	// a new key is most often a filter miss, and goes straight to the end of its chain
+	hash_bucket_piece_t* p = _hash_bucket_filter_may_contain(b, key) ?
+		_hash_table_find_entry(ctx, b, hash % NUMBER_OF_HASH_BUCKET_PIECES, tmp_buffer, key_size, &cur_buf_start, &scanned) : NULL;
+
+	uint64_t v = 0;
+	uint8_t* buf = NULL;
+	if (p) {
+		buf = cur_buf_start + key_size;
+		_hash_table_read_value(ctx, &buf, &v);
+		if (old_value) {
+			old_value->exists = true;
+			old_value->value = v;
+		}
+	}
+	if (merge) {
+		*value = merge(key, v, p != NULL, arg);
+		if (!_hash_table_value_fits(ctx, *value))
+			return false;
+	}
+	uint8_t* buf_end = tmp_buffer + key_size;
+	_hash_table_write_value(ctx, *value, &buf_end);
+	uint8_t encoded_size = (uint8_t)(buf_end - tmp_buffer);
+
+	if (!p)
+		return _hash_table_append_entry(ctx, b, key, hash, tmp_buffer, encoded_size);
+	if (v == *value)
+		return true; // nothing to do, value is already there
+	return _hash_table_rewrite_entry(ctx, b, p, cur_buf_start, (uint8_t)(buf - cur_buf_start), key, hash, tmp_buffer, encoded_size);
+}
+
+static bool _hash_table_upsert(hash_ctx_t* ctx, uint64_t key, uint64_t value, hash_merge_fn_t merge, void* arg, hash_old_value_t* old_value) {
+	if (old_value)
+		old_value->exists = false;
+	if (!_hash_table_unshare_directory(ctx))
+		return false;
+
+	uint64_t hash = _hash_table_hash(ctx, key);
+	ctx->dir->version++;
+	HASH_STAT_ADD(ctx, puts, 1);
+
+	uint8_t tmp_buffer[20]; // each varint can take up to 10 bytes
+
+	while (true) {
+		uint32_t bucket_idx = _hash_table_bucket_number(ctx, hash);
+		hash_bucket_t* b = _hash_table_unshare_bucket(ctx, hash_directory_bucket(ctx, ctx->dir, bucket_idx), hash);
+		if (!b)
+			return false;
+		// the stored key depends on the bucket's depth, a split changes it
+		uint8_t key_size = _hash_bucket_encode_key(ctx, b, key, hash, tmp_buffer);
+
+		_hash_bucket_write_begin(ctx, b);
+		if (_hash_table_replace_in_bucket(ctx, b, key, hash, tmp_buffer, key_size, &value, merge, arg, old_value)) {
+			_hash_bucket_write_end(ctx, b);
+			return _hash_table_log(ctx, HASH_CHANGE_PUT, key, value); // the merged value, replaying doesn't merge again
+		}
+		if (!_hash_table_value_fits(ctx, value)) {
+			_hash_bucket_write_end(ctx, b);
+			errno = ERANGE;
+			return false;
+		}
+		// the stored value is still the one merged, so the retry stores what we have
+		merge = NULL;
+
+		// there is no room here, need to expand and try again
+		bool split = _hash_table_put_increase_size(ctx, b, hash);
+		_hash_bucket_write_end(ctx, b);
+		if (!split)
+			return false;
+	}
+}
+
+bool hash_table_replace(hash_ctx_t* ctx, uint64_t key, uint64_t value, hash_old_value_t* old_value) {
+	if (!_hash_table_writable(ctx))
+		return false;
+	if (!_hash_table_value_fits(ctx, value)) {
+		errno = ERANGE;
+		return false;
+	}
+	return _hash_table_upsert(ctx, key, value, NULL, NULL, old_value);
+}
+
+bool hash_table_upsert(hash_ctx_t* ctx, uint64_t key, hash_merge_fn_t merge, void* arg) {
+	if (!_hash_table_writable(ctx))
+		return false;
+	return _hash_table_upsert(ctx, key, 0, merge, arg, NULL);
+}
+
+uint64_t hash_merge_add(uint64_t key, uint64_t value, bool exists, void* arg) {
+	(void)key;
+	(void)exists;
+	return value + *(uint64_t*)arg; // value is 0 when the key isn't there
+}
+
+uint64_t hash_merge_max(uint64_t key, uint64_t value, bool exists, void* arg) {
+	(void)key;
+	uint64_t operand = *(uint64_t*)arg;
+	return exists && value > operand ? value : operand;
+}
+
+uint64_t hash_merge_min(uint64_t key, uint64_t value, bool exists, void* arg) {
+	(void)key;
+	uint64_t operand = *(uint64_t*)arg;
+	return exists && value < operand ? value : operand;
+}
+
+uint64_t hash_merge_or(uint64_t key, uint64_t value, bool exists, void* arg) {
+	(void)key;
+	(void)exists;
+	return value | *(uint64_t*)arg;
+}
+
+// what follows a multimap key in its entry
+typedef struct hash_multimap_values {
+	uint64_t count;
+	uint8_t* data; // the deltas, in the entry or the run
+	uint32_t size;
+	hash_value_run_t* run; // NULL while they are in the entry
+	uint8_t entry_size; // of the part after the key
+} hash_multimap_values_t;
+
+static void _hash_multimap_read(hash_ctx_t* ctx, uint8_t* values, hash_multimap_values_t* v) {
+	uint8_t* buf = values;
+	uint64_t header;
+	varint_decode(&buf, &header);
+	if (header & 1) {
+		v->run = _hash_multimap_run_at(ctx, buf);
+		memcpy(&v->count, buf + sizeof(hash_page_ref_t), sizeof(uint64_t));
+		v->data = v->run->data;
+		v->size = v->run->bytes_used;
+		buf += sizeof(hash_page_ref_t) + sizeof(uint64_t);
 	}
-	return total;
+	else {
+		uint64_t size;
+		varint_decode(&buf, &size);
+		v->run = NULL;
+		v->count = header >> 1;
+		v->data = buf;
+		v->size = (uint32_t)size;
+		buf += size;
+	}
+	v->entry_size = (uint8_t)(buf - values);
 }
 
-static bool _hash_bucket_copy(hash_bucket_t* dst, hash_bucket_t* src) {
-	for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++)
+static uint64_t _hash_multimap_last(const hash_multimap_values_t* v) {
+	if (v->run)
+		return v->run->last;
+	uint64_t last = 0;
+	for (uint8_t* buf = v->data; buf < v->data + v->size;)
 	{
-		uint8_t* buf = src->pieces[i].data;
-		uint8_t* end = buf + src->pieces[i].bytes_used;
-		while (buf < end)
-		{
-			uint64_t k, v;
-			uint8_t* start = buf;
-			varint_decode(&buf, &k);
-			varint_decode(&buf, &v);
-			if (!_hash_table_piece_append_kv(dst, k % NUMBER_OF_HASH_BUCKET_PIECES, start, (uint8_t)(buf - start))) {
-				return false;
-			}
-		}
+		uint64_t delta;
+		varint_decode(&buf, &delta);
+		last += delta;
 	}
-	return true;
+	return last;
 }
 
-static void _hash_table_compact_pages(hash_ctx_t* ctx, uint64_t key, uint32_t bucket_idx) {
-	if (ctx->dir->number_of_buckets <= 2)
-		return; // can't compact if we have just 2 pages
-	hash_bucket_t* left = ctx->dir->buckets[bucket_idx];
-	uint32_t sibling_idx = bucket_idx ^ ((uint64_t)1 << (left->depth - 1));
-	hash_bucket_t* right = ctx->dir->buckets[sibling_idx];
-	if (_get_bucket_size(right) + _get_bucket_size(left) > HASH_BUCKET_PAGE_SIZE_MERGE_LIMIT)
-		return; // too big for compaction, we'll try again later
+// writes the part of the entry after the key for a run, it keeps its size while the run changes
+static inline uint8_t* _hash_multimap_write_run_ref(hash_ctx_t* ctx, uint8_t* buf, hash_value_run_t* run, uint64_t count) {
+	hash_page_ref_t ref = hash_page_ref(ctx, run);
+	*buf++ = 1;
+	memcpy(buf, &ref, sizeof(hash_page_ref_t));
+	memcpy(buf + sizeof(hash_page_ref_t), &count, sizeof(uint64_t));
+	return buf + sizeof(hash_page_ref_t) + sizeof(uint64_t);
+}
 
-	hash_bucket_t* merged = _create_hash_bucket(ctx);
-	// we couldn't merge, out of mem, but that is fine, we don't *have* to
-	if (!merged)
-		return;
+// makes edit to the values of the entry of key at entry, in p, with count values after it. buffer
+// holds the encoded key. Returns false if there is no room in b for the entry, errno is set when
+// it failed for another reason, b is left as it was either way.
+static bool _hash_multimap_edit_entry(hash_ctx_t* ctx, hash_bucket_t* b, hash_bucket_piece_t* p, uint8_t* entry, uint64_t key, uint64_t hash, uint8_t* buffer, uint8_t key_size, hash_multimap_values_t* v, uint64_t count, const hash_multimap_edit_t* edit) {
+	uint8_t* values = entry + key_size;
+	if (v->run) {
+		hash_value_run_t* run = _hash_multimap_edit_run(ctx, v->run, count, edit);
+		if (!run)
+			return false;
+		_hash_multimap_write_run_ref(ctx, values, run, count);
+		return true;
+	}
 
-	merged->depth = left->depth < right->depth ? left->depth : right->depth;
-	merged->depth--;
-	if (!_hash_bucket_copy(merged, left) || !_hash_bucket_copy(merged, right)) {
-		// failed to copy, sad, but we'll try again later
-		ctx->release_page(merged);
-		return;
+	uint32_t size = v->size - edit->removed + edit->inserted_size;
+	uint8_t* end = buffer + key_size;
+	hash_value_run_t* run = NULL;
+	if (size <= HASH_MULTIMAP_INLINE_SIZE) {
+		varint_encode(count << 1, &end);
+		varint_encode(size, &end);
+		_hash_multimap_splice(end, v->data, v->size, edit);
+		end += size;
 	}
-	_validate_bucket(ctx, merged);
+	else {
+		run = _hash_multimap_create_run(ctx, v->data, v->size, count, edit, 1);
+		if (!run)
+			return false;
+		end = _hash_multimap_write_run_ref(ctx, end, run, count);
+	}
+	errno = 0;
+	if (_hash_table_rewrite_entry(ctx, b, p, entry, key_size + v->entry_size, key, hash, buffer, (uint8_t)(end - buffer)))
+		return true;
+	if (run)
+		_hash_table_free_pages(ctx, run, run->pages); // never seen by anyone
+	return false;
+}
 
-	size_t bit = (uint64_t)1 << merged->depth;
-	for (size_t i = key & (bit - 1); i < ctx->dir->number_of_buckets; i += bit)
-	{
-		ctx->dir->buckets[i] = merged;
+// adds value to key's in b, buffer holds the encoded key. Returns false as _hash_multimap_edit_entry
+// does, *added says whether value wasn't there yet.
+static bool _hash_multimap_add_in_bucket(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t key, uint64_t hash, uint8_t* buffer, uint8_t key_size, uint64_t value, bool* added) {
+	*added = false;
+	uint8_t* entry;
+	size_t scanned;
+	hash_bucket_piece_t* p = _hash_bucket_filter_may_contain(b, key) ?
+		_hash_table_find_entry(ctx, b, hash % NUMBER_OF_HASH_BUCKET_PIECES, buffer, key_size, &entry, &scanned) : NULL;
+	errno = 0;
+	if (!p) {
+		uint8_t* end = buffer + key_size;
+		varint_encode(1 << 1, &end);
+		varint_encode(_varint_size(value), &end);
+		varint_encode(value, &end);
+		return *added = _hash_table_append_entry(ctx, b, key, hash, buffer, (uint8_t)(end - buffer));
 	}
-	ctx->release_page(right);
-	ctx->release_page(left);
 
-	size_t max_depth = 0;
-	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++)
-	{
-		if (ctx->dir->depth > max_depth)
-			max_depth = ctx->dir->depth;
+	hash_multimap_values_t v;
+	_hash_multimap_read(ctx, entry + key_size, &v);
+	hash_multimap_edit_t edit;
+	if (!_hash_multimap_edit_add(v.data, v.size, v.count, _hash_multimap_last(&v), value, &edit))
+		return true;
+	return *added = _hash_multimap_edit_entry(ctx, b, p, entry, key, hash, buffer, key_size, &v, v.count + 1, &edit);
+}
+
+bool hash_table_add(hash_ctx_t* ctx, uint64_t key, uint64_t value) {
+	if (!_hash_table_writable(ctx))
+		return false;
+	if (ctx->layout != HASH_LAYOUT_MULTIMAP) {
+		errno = EINVAL;
+		return false;
 	}
-	if (max_depth == ctx->dir->depth)
-		return;
+	if (!_hash_table_unshare_directory(ctx))
+		return false;
 
-	// we can decrease the size of the directory now
-	ctx->dir->depth--;
-	ctx->dir->number_of_buckets /= 2;
+	uint64_t hash = _hash_table_hash(ctx, key);
+	ctx->dir->version++;
+	HASH_STAT_ADD(ctx, puts, 1);
 
-	if (ctx->dir->number_of_buckets == 1 || 
-		(size_t)ctx->dir->number_of_buckets * 2 * sizeof(hash_bucket_t*) >= _hash_table_get_directory_capacity(ctx))
-		return; // we are using more than half the space, nothing to touch here
+	uint8_t buffer[PIECE_BUCKET_BUFFER_SIZE];
+	while (true) {
+		uint32_t bucket_idx = _hash_table_bucket_number(ctx, hash);
+		hash_bucket_t* b = _hash_table_unshare_bucket(ctx, hash_directory_bucket(ctx, ctx->dir, bucket_idx), hash);
+		if (!b)
+			return false;
+		uint8_t key_size = _hash_bucket_encode_key(ctx, b, key, hash, buffer);
 
-	hash_directory_t* new_dir = ctx->allocate_page(ctx->dir->directory_pages / 2);
-	if (new_dir != NULL) { // if we can't allocate, just ignore this, it is fine
-		size_t dir_size = (size_t)(ctx->dir->directory_pages / 2) * HASH_BUCKET_PAGE_SIZE;
-		memcpy(new_dir, ctx->dir, dir_size);
-		new_dir->directory_pages /= 2;
-		ctx->release_page(ctx->dir);
-		ctx->dir = new_dir;
+		bool added;
+		_hash_bucket_write_begin(ctx, b);
+		if (_hash_multimap_add_in_bucket(ctx, b, key, hash, buffer, key_size, value, &added)) {
+			_hash_bucket_write_end(ctx, b);
+			return !added || _hash_table_log(ctx, HASH_CHANGE_ADD, key, value);
+		}
+		if (errno) {
+			_hash_bucket_write_end(ctx, b);
+			return false;
+		}
+		bool split = _hash_table_put_increase_size(ctx, b, hash);
+		_hash_bucket_write_end(ctx, b);
+		if (!split)
+			return false;
 	}
 }
 
-bool hash_table_delete(hash_ctx_t* ctx, uint64_t key, hash_old_value_t* old_value) {
-	uint32_t bucket_idx = _hash_table_bucket_number(ctx, key);
-	hash_bucket_t* b = ctx->dir->buckets[bucket_idx];
-	uint32_t piece_idx = key % NUMBER_OF_HASH_BUCKET_PIECES;
+// calls fn with the values after a multimap key, as found in its entry
+static size_t _hash_multimap_visit(hash_ctx_t* ctx, uint64_t key, uint8_t* values, hash_value_fn_t fn, void* arg) {
+	hash_multimap_values_t v;
+	_hash_multimap_read(ctx, values, &v);
+	uint8_t* buf = v.data;
+	uint64_t value = 0;
+	for (uint64_t i = 0; i < v.count; i++)
+	{
+		uint64_t delta;
+		varint_decode(&buf, &delta);
+		value += delta;
+		if (!fn(key, value, arg))
+			return i + 1;
+	}
+	return v.count;
+}
+
+size_t hash_table_get_all(hash_ctx_t* ctx, uint64_t key, hash_value_fn_t fn, void* arg) {
+	uint64_t hash = _hash_table_hash(ctx, key);
+	uint64_t count;
+	if (ctx->concurrent) {
+		if (!hash_epoch_enter()) {
+			errno = EBUSY;
+			return 0;
+		}
+		// the run of the entry found stays as it was up to its count, and in memory until we leave
+		uint8_t values[PIECE_BUCKET_BUFFER_SIZE];
+		size_t n = _hash_table_get_optimistic(ctx, key, hash, &count, values) ? _hash_multimap_visit(ctx, key, values, fn, arg) : 0;
+		hash_epoch_exit();
+		return n;
+	}
+
+	hash_bucket_t* b = hash_directory_bucket(ctx, ctx->dir, _hash_table_bucket_number(ctx, hash));
+	size_t scanned = 0;
+	uint8_t* entry = NULL;
+	bool found = false;
+	if (_hash_bucket_filter_may_contain(b, key)) {
+		uint8_t encoded_key[10];
+		uint8_t key_size = _hash_bucket_encode_key(ctx, b, key, hash, encoded_key);
+		found = _hash_table_find_entry(ctx, b, hash % NUMBER_OF_HASH_BUCKET_PIECES, encoded_key, key_size, &entry, &scanned) != NULL;
+		if (found)
+			entry += key_size;
+	}
+	_hash_table_count_get(ctx, scanned, scanned == 0, found);
+	return found ? _hash_multimap_visit(ctx, key, entry, fn, arg) : 0;
+}
+
+bool hash_table_remove_value(hash_ctx_t* ctx, uint64_t key, uint64_t value) {
+	if (!_hash_table_writable(ctx))
+		return false;
+	errno = 0;
+	if (ctx->layout != HASH_LAYOUT_MULTIMAP) {
+		errno = EINVAL;
+		return false;
+	}
+	uint64_t hash = _hash_table_hash(ctx, key);
+	hash_bucket_t* b = hash_directory_bucket(ctx, ctx->dir, _hash_table_bucket_number(ctx, hash));
+	if (!_hash_bucket_filter_may_contain(b, key))
+		return false;
+	uint8_t buffer[PIECE_BUCKET_BUFFER_SIZE];
+	uint8_t key_size = _hash_bucket_encode_key(ctx, b, key, hash, buffer);
+	uint8_t* entry;
+	size_t scanned;
+	hash_bucket_piece_t* p = _hash_table_find_entry(ctx, b, hash % NUMBER_OF_HASH_BUCKET_PIECES, buffer, key_size, &entry, &scanned);
+	if (!p)
+		return false;
+	hash_multimap_values_t v;
+	_hash_multimap_read(ctx, entry + key_size, &v);
+	hash_multimap_edit_t edit;
+	if (!_hash_multimap_edit_remove(v.data, v.size, _hash_multimap_last(&v), value, &edit))
+		return false;
+	if (v.count == 1)
+		return hash_table_delete(ctx, key, NULL);
 
+	if (!_hash_table_unshare_directory(ctx))
+		return false;
 	ctx->dir->version++;
+	HASH_STAT_ADD(ctx, deletes, 1);
+	hash_bucket_t* copy = _hash_table_unshare_bucket(ctx, b, hash);
+	if (!copy)
+		return false;
+	if (copy != b) {
+		// the entry is at the same place in the copy, its values too if they are in it
+		p = (hash_bucket_piece_t*)((uint8_t*)copy + ((uint8_t*)p - (uint8_t*)b));
+		entry = (uint8_t*)copy + (entry - (uint8_t*)b);
+		_hash_multimap_read(ctx, entry + key_size, &v);
+		b = copy;
+	}
+	// fewer values never take more room, with or without a run
+	_hash_bucket_write_begin(ctx, b);
+	bool removed = _hash_multimap_edit_entry(ctx, b, p, entry, key, hash, buffer, key_size, &v, v.count - 1, &edit);
+	_hash_bucket_write_end(ctx, b);
+	return removed && _hash_table_log(ctx, HASH_CHANGE_REMOVE_VALUE, key, value);
+}
 
-	if (old_value)
-		old_value->exists = false;
 
-	for (size_t i = 0; i < MAX_CHAIN_LENGTH; i++)
+// releases the directory and every bucket in it. A bucket of depth d shows up in all the slots
+// that share its low d bits, the first of them (slot < 2^d) is the one that releases it. Going
+// from the last slot down, we are done reading a bucket's depth before it is released. An
+// unlinked directory was the table's, its pages go through _hash_table_release_page, otherwise
+// nothing else can have them and they are freed.
+static void _hash_table_release_directory(hash_ctx_t* ctx, hash_directory_t* dir, bool unlinked) {
+	for (size_t i = dir->number_of_buckets; i-- > 0;)
 	{
-		uint32_t cur_piece_idx = (piece_idx + i) % NUMBER_OF_HASH_BUCKET_PIECES;
-		hash_bucket_piece_t* p = &b->pieces[cur_piece_idx];
-		uint8_t* buf = p->data;
-		uint8_t* end = p->data + p->bytes_used;
-		while (buf < end)
-		{
-			uint64_t k, v;
-			uint8_t* cur_buf_start = buf;
-			varint_decode(&buf, &k);
-			varint_decode(&buf, &v);
-
-			if (k == key) {
+		hash_bucket_t* b = hash_directory_bucket(ctx, dir, i);
+		if (i >= ((size_t)1 << b->depth))
+			continue;
+		hash_bucket_for_each_run(ctx, b, _hash_multimap_release_ref, &unlinked);
+		if (unlinked)
+			_hash_table_release_page(ctx, b, 1, b->generation);
+		else
+			_hash_table_free_pages(ctx, b, 1);
+	}
+	for (size_t s = 0; s < _hash_table_get_directory_capacity(dir); s++)
+	{
+		if (!dir->segments[s])
+			continue;
+		if (unlinked)
+			_hash_table_release_page(ctx, hash_page_at(ctx, dir->segments[s]), 1, _hash_table_segment_generation(ctx, s));
+		else
+			_hash_table_free_pages(ctx, hash_page_at(ctx, dir->segments[s]), 1);
+	}
+	if (unlinked)
+		_hash_table_release_page(ctx, dir, dir->directory_pages, dir->generation);
+	else
+		_hash_table_free_pages(ctx, dir, dir->directory_pages);
+}
 
-				if (old_value) {
-					old_value->exists = true;
-					old_value->value = v;
-				}
+// the directory depth at which bucket_bytes of entries fill the buckets to HASH_BULK_LOAD_FILL_PERCENT at most
+static uint8_t _hash_table_depth_for(uint64_t bytes) {
+	uint64_t per_bucket = (uint64_t)NUMBER_OF_HASH_BUCKET_PIECES * PIECE_BUCKET_BUFFER_SIZE * HASH_BULK_LOAD_FILL_PERCENT / 100;
+	uint8_t depth = 1;
+	while (depth < HASH_DIRECTORY_MAX_DEPTH && ((uint64_t)per_bucket << depth) < bytes)
+		depth++;
+	return depth;
+}
 
-				ptrdiff_t diff = buf - cur_buf_start;
-				memmove(cur_buf_start, buf, end - buf);
-				p->bytes_used -= (uint8_t)diff;
-				b->number_of_entries--;
-				ctx->dir->number_of_entries--;
-
-				if (p->bytes_used == 0) {
-					if (!_hash_table_overflow_merge(ctx, b, cur_piece_idx)) {
-						_hash_table_compact_pages(ctx, key, bucket_idx);
-					}
-				}
+// replaces the empty table's directory with a 2^depth one, for each pair of sibling slots
+// merge_siblings[i] says whether they share a single bucket of depth - 1
+static bool _hash_table_reserve(hash_ctx_t* ctx, uint8_t depth, const bool* merge_siblings) {
+	size_t number_of_buckets = (size_t)1 << depth;
+	size_t segments = _hash_table_segments_for(number_of_buckets);
+	uint32_t pages = 1;
+	while (((size_t)pages * HASH_BUCKET_PAGE_SIZE - sizeof(hash_directory_t)) / sizeof(hash_page_ref_t) < segments)
+		pages *= 2;
+	if (!_hash_table_unshare_directory(ctx))
+		return false;
 
-				return true;
-			}
+	hash_directory_t* dir = _hash_table_allocate_pages(ctx, pages);
+	if (!dir)
+		return false;
+	memset(dir, 0, (size_t)pages * HASH_BUCKET_PAGE_SIZE);
+	dir->directory_pages = pages;
+	dir->depth = depth;
+	// the buckets of the merged siblings are the ones of depth - 1, counted as they are made
+	dir->buckets_at_depth[depth] = (uint32_t)number_of_buckets;
+	dir->mix = ctx->dir->mix;
+	dir->compress_keys = ctx->dir->compress_keys;
+	dir->layout = ctx->dir->layout;
+	dir->version = ctx->dir->version + 1;
+	dir->generation = ctx->dir->generation;
+
+	// every slot is set, so every segment is needed
+	for (size_t s = 0; s < segments; s++)
+	{
+		void* segment = _hash_table_allocate_pages(ctx, 1);
+		if (!segment) {
+			_hash_table_release_directory(ctx, dir, false);
+			return false;
 		}
+		dir->segments[s] = hash_page_ref(ctx, segment);
+		dir->segment_pages++;
+	}
 
-		// if we are looking at an overflow page, move to the next one and try to find it there
-		if (!p->overflowed)
-			break;
+	size_t half = number_of_buckets / 2;
+	for (size_t i = 0; i < number_of_buckets; i++)
+	{
+		hash_page_ref_t* slot = &hash_directory_segment(ctx, dir, i)[i & (HASH_DIRECTORY_SEGMENT_SLOTS - 1)];
+		if (i >= half && merge_siblings && merge_siblings[i - half]) {
+			*slot = hash_page_ref(ctx, hash_directory_bucket(ctx, dir, i - half));
+			dir->number_of_buckets++;
+			continue;
+		}
+		hash_bucket_t* b = _hash_table_allocate_pages(ctx, 1);
+		if (!b) {
+			_hash_table_release_directory(ctx, dir, false);
+			return false;
+		}
+		memset(b, 0, sizeof(hash_bucket_t));
+		b->generation = dir->generation;
+		b->depth = i < half && merge_siblings && merge_siblings[i] ? depth - 1 : depth;
+		if (b->depth != depth) {
+			dir->buckets_at_depth[depth] -= 2;
+			dir->buckets_at_depth[depth - 1]++;
+		}
+		b->prefix = (uint32_t)(i & (((size_t)1 << b->depth) - 1));
+		*slot = hash_page_ref(ctx, b);
+		dir->number_of_buckets++;
+		dir->number_of_bucket_pages++;
 	}
 
-	return false;
+	hash_directory_t* old_dir = ctx->dir;
+	__atomic_store_n(&ctx->dir, dir, __ATOMIC_RELEASE);
+	_hash_table_release_directory(ctx, old_dir, true);
+	// the old segments are released by their own generations, only then are they replaced
+	for (size_t s = 0; s < segments; s++)
+		_hash_table_set_segment_generation(ctx, s);
+	return true;
 }
 
-bool hash_table_put(hash_ctx_t* ctx, uint64_t key, uint64_t value) {
-	return hash_table_replace(ctx, key, value, NULL);
+static bool _hash_table_bulk_insert(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t key, uint64_t value) {
+	uint8_t buffer[20];
+	uint64_t hash = _hash_table_hash(ctx, key);
+	uint8_t key_size = _hash_bucket_encode_key(ctx, b, key, hash, buffer);
+	// goes through the regular path, which also takes care of duplicate keys, later ones win
+	return _hash_table_replace_in_bucket(ctx, b, key, hash, buffer, key_size, &value, NULL, NULL, NULL);
 }
 
-bool hash_table_replace(hash_ctx_t* ctx, uint64_t key, uint64_t value, hash_old_value_t* old_value) {
-	uint32_t bucket_idx = _hash_table_bucket_number(ctx, key);
-	hash_bucket_t* b = ctx->dir->buckets[bucket_idx];
-	uint32_t piece_idx = key % NUMBER_OF_HASH_BUCKET_PIECES;
-
-	ctx->dir->version++;
+bool hash_table_bulk_load(hash_ctx_t* ctx, const uint64_t* keys, const uint64_t* values, size_t n) {
+	if (!_hash_table_writable(ctx))
+		return false;
+	if (ctx->dir->number_of_entries) {
+		errno = EINVAL;
+		return false;
+	}
 
-	uint8_t tmp_buffer[20]; // each varint can take up to 10 bytes
-	uint8_t* buf_end = tmp_buffer;
-	varint_encode(key, &buf_end);
-	uint8_t* key_end = buf_end;
-	varint_encode(value, &buf_end);
-	ptrdiff_t encoded_size = buf_end - tmp_buffer;
+	uint64_t total = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		if (!_hash_table_value_fits(ctx, values[i])) {
+			errno = ERANGE;
+			return false;
+		}
+		total += _hash_table_entry_size(ctx, keys[i], values[i]);
+	}
 
-	if (old_value)
-		old_value->exists = false;
+	uint8_t depth = _hash_table_depth_for(total);
+	size_t number_of_buckets = (size_t)1 << depth;
+	size_t* order = malloc(n * sizeof(size_t));
+	size_t* offsets = calloc(number_of_buckets + 1, sizeof(size_t));
+	uint64_t* bytes = calloc(number_of_buckets, sizeof(uint64_t));
+	bool* merge_siblings = calloc(number_of_buckets / 2, sizeof(bool));
+	bool (*log_change)(hash_ctx_t*, hash_change_t, uint64_t, uint64_t) = ctx->log_change;
+	bool result = false;
+	if (!order || !offsets || !bytes || !merge_siblings) {
+		errno = ENOMEM;
+		goto done;
+	}
 
-	for (size_t i = 0; i < MAX_CHAIN_LENGTH; i++)
+	// partition the input by the low bits of the hash, which is the order of the directory
+	uint64_t mask = number_of_buckets - 1;
+	for (size_t i = 0; i < n; i++)
 	{
-		hash_bucket_piece_t* p = &b->pieces[(piece_idx + i) % NUMBER_OF_HASH_BUCKET_PIECES];
-		uint8_t* buf = p->data;
-		uint8_t* end = p->data + p->bytes_used;
-		while (buf < end)
+		size_t slot = _hash_table_hash(ctx, keys[i]) & mask;
+		offsets[slot + 1]++;
+		bytes[slot] += _hash_table_entry_size(ctx, keys[i], values[i]);
+	}
+	for (size_t i = 0; i < number_of_buckets; i++)
+		offsets[i + 1] += offsets[i];
+	for (size_t i = 0; i < n; i++)
+		order[offsets[_hash_table_hash(ctx, keys[i]) & mask]++] = i;
+	for (size_t i = number_of_buckets; i > 0; i--)
+		offsets[i] = offsets[i - 1];
+	offsets[0] = 0;
+
+	// rounding the depth up to a power of two can leave the buckets half empty, so siblings
+	// that fit in one bucket together get a single bucket
+	uint64_t per_bucket = (uint64_t)NUMBER_OF_HASH_BUCKET_PIECES * PIECE_BUCKET_BUFFER_SIZE * HASH_BULK_LOAD_FILL_PERCENT / 100;
+	for (size_t i = 0; depth > 1 && i < number_of_buckets / 2; i++)
+		merge_siblings[i] = bytes[i] + bytes[i + number_of_buckets / 2] <= per_bucket;
+
+	// the leftovers are put below, the log gets the entries in their order once they are all in
+	ctx->log_change = NULL;
+	if (!_hash_table_reserve(ctx, depth, merge_siblings))
+		goto done;
+
+	// each bucket page is filled in one go, whatever doesn't fit (skewed keys) is added later
+	size_t leftovers = 0;
+	for (size_t i = 0; i < number_of_buckets; i++)
+	{
+		hash_bucket_t* b = hash_directory_bucket(ctx, ctx->dir, i);
+		_hash_bucket_write_begin(ctx, b);
+		bool full = false;
+		for (size_t j = offsets[i]; j < offsets[i + 1]; j++)
 		{
-			uint64_t k, v;
-			uint8_t* cur_buf_start = buf;
-			varint_decode(&buf, &k);
-			varint_decode(&buf, &v);
-
-			if (k == key) {
-
-				if (old_value) {
-					old_value->exists = true;
-					old_value->value = v;
-				}
-
-				if (v == value)
-					return true; // nothing to do, value is already there
-				ptrdiff_t diff = buf - cur_buf_start;
-				if (diff == encoded_size) {
-					// new value fit exactly where the old one went, let's put it there
-					memcpy(cur_buf_start, tmp_buffer, encoded_size);
-					_validate_bucket(ctx, b);
-					return true;
-				}
-
-				memmove(cur_buf_start, buf, end - buf);
-				p->bytes_used -= (uint8_t)diff;
-				b->number_of_entries--;
-				ctx->dir->number_of_entries--;
-				break; // found it, let's put this in 
+			// past the first entry that doesn't fit, the rest of the bucket's entries are put
+			// later too, in order, so a later duplicate of a key still wins over that one
+			if (full || !_hash_table_bulk_insert(ctx, b, keys[order[j]], values[order[j]])) {
+				order[leftovers++] = order[j];
+				full = true;
 			}
 		}
+		_hash_bucket_write_end(ctx, b);
+	}
 
-		if (p->bytes_used + encoded_size <= PIECE_BUCKET_BUFFER_SIZE) {
-			memcpy(p->data + p->bytes_used, tmp_buffer, encoded_size);
-			p->bytes_used += (uint8_t)encoded_size;
-			b->number_of_entries++;
-			ctx->dir->number_of_entries++;
-
-			_validate_bucket(ctx, b);
-			return true; // was able to update the value in the same piece, done
-		}
+	result = true;
+	for (size_t i = 0; i < leftovers && result; i++)
+		result = hash_table_put(ctx, keys[order[i]], values[order[i]]);
+
+	ctx->log_change = log_change;
+	for (size_t i = 0; i < n && result; i++)
+		result = _hash_table_log(ctx, HASH_CHANGE_PUT, keys[i], values[i]);
+
+done:
+	ctx->log_change = log_change;
+	free(merge_siblings);
+	free(bytes);
+	free(offsets);
+	free(order);
+	return result;
+}
 
-		// if we are looking at an overflow page, move to the next one and try to find it there
-		if (!p->overflowed)
-			break;
+bool hash_table_bulk_load_stream(hash_ctx_t* ctx, hash_bulk_load_next_t next, void* state, size_t expected_entries) {
+	if (!_hash_table_writable(ctx))
+		return false;
+	if (ctx->dir->number_of_entries) {
+		errno = EINVAL;
+		return false;
 	}
-	// couldn't find it in the proper place, let's put it in overflow
-	for (size_t i = 0; i < MAX_CHAIN_LENGTH; i++) {
-		hash_bucket_piece_t* p = &b->pieces[(piece_idx + i) % NUMBER_OF_HASH_BUCKET_PIECES];
-		if (p->bytes_used + encoded_size <= PIECE_BUCKET_BUFFER_SIZE) {
-			memcpy(p->data + p->bytes_used, tmp_buffer, encoded_size);
-			p->bytes_used += (uint8_t)encoded_size;
-			b->number_of_entries++;
-			ctx->dir->number_of_entries++;
 
-			_validate_bucket(ctx, b);
-			return true; // was able to update the value in the same piece, done
-		}
-		p->overflowed = true;
+	// the first entries tell us the average entry size, so we can size the directory up front
+	uint64_t* keys = malloc(HASH_BULK_LOAD_SAMPLE * sizeof(uint64_t));
+	uint64_t* values = malloc(HASH_BULK_LOAD_SAMPLE * sizeof(uint64_t));
+	bool result = false;
+	if (!keys || !values) {
+		errno = ENOMEM;
+		goto done;
 	}
 
-	// there is no room here, need to expand
-	return _hash_table_put_increase_size(ctx, b, key, value, tmp_buffer, (uint8_t)encoded_size);
+	size_t sampled = 0;
+	uint64_t sample_bytes = 0;
+	while (sampled < HASH_BULK_LOAD_SAMPLE && next(state, &keys[sampled], &values[sampled]))
+	{
+		sample_bytes += _hash_table_entry_size(ctx, keys[sampled], values[sampled]);
+		sampled++;
+	}
+	if (sampled && expected_entries > sampled &&
+		!_hash_table_reserve(ctx, _hash_table_depth_for(sample_bytes * expected_entries / sampled), NULL))
+		goto done;
+
+	result = true;
+	for (size_t i = 0; i < sampled && result; i++)
+		result = hash_table_put(ctx, keys[i], values[i]);
+
+	uint64_t key, value;
+	while (result && next(state, &key, &value))
+		result = hash_table_put(ctx, key, value);
+
+done:
+	free(values);
+	free(keys);
+	return result;
 }
 
-
 bool hash_table_init(hash_ctx_t* ctx) {
-	ctx->dir = ctx->allocate_page(1);
+	ctx->retired = NULL;
+	ctx->retired_count = ctx->retired_capacity = 0;
+	ctx->snapshots = NULL;
+	ctx->snapshots_count = ctx->snapshots_capacity = 0;
+	ctx->shared = NULL;
+	ctx->shared_count = ctx->shared_capacity = 0;
+	ctx->segment_generations = NULL;
+	ctx->segment_generations_capacity = 0;
+	ctx->compaction_candidates = NULL;
+	ctx->compaction_count = ctx->compaction_capacity = 0;
+#if HASH_STATS
+	memset(ctx->stats, 0, sizeof(ctx->stats));
+#endif
+	if (ctx->compress_keys && ctx->mix == HASH_MIX_WYHASH) {
+		errno = EINVAL; // the keys couldn't be recovered from their hashes
+		return false;
+	}
+	if (ctx->layout > HASH_LAYOUT_MULTIMAP) {
+		errno = EINVAL;
+		return false;
+	}
+
+	ctx->dir = _hash_table_allocate_pages(ctx, 1);
 	if (ctx->dir == NULL)
 		return false;
 
 	memset(ctx->dir, 0, HASH_BUCKET_PAGE_SIZE);
 	ctx->dir->number_of_entries = 0;
 	ctx->dir->number_of_buckets = 2;
+	ctx->dir->number_of_bucket_pages = 2;
 	ctx->dir->directory_pages = 1;
+	ctx->dir->segment_pages = 1;
 	ctx->dir->depth = 1;
-
-	ctx->dir->buckets[0] = _create_hash_bucket(ctx);
-	ctx->dir->buckets[1] = _create_hash_bucket(ctx);
-
-	if (!ctx->dir->buckets[0] || !ctx->dir->buckets[1]) {
-		ctx->release_page(ctx->dir->buckets[0]);
-		ctx->release_page(ctx->dir->buckets[1]);
-		ctx->release_page(ctx->dir);
+	ctx->dir->buckets_at_depth[1] = 2;
+	ctx->dir->generation = 1; // a segment of generation 0 is one whose generation isn't known
+	ctx->dir->mix = ctx->mix;
+	ctx->dir->compress_keys = ctx->compress_keys;
+	ctx->dir->layout = ctx->layout;
+
+	hash_page_ref_t* segment = _hash_table_allocate_pages(ctx, 1);
+	hash_bucket_t* first = _create_hash_bucket(ctx);
+	hash_bucket_t* second = _create_hash_bucket(ctx);
+
+	if (!segment || !first || !second) {
+		if (segment)
+			_hash_table_free_pages(ctx, segment, 1);
+		if (first)
+			_hash_table_free_pages(ctx, first, 1);
+		if (second)
+			_hash_table_free_pages(ctx, second, 1);
+		_hash_table_free_pages(ctx, ctx->dir, 1);
 		return false;
 	}
+	memset(segment, 0, HASH_BUCKET_PAGE_SIZE);
+	second->prefix = 1;
+	segment[0] = hash_page_ref(ctx, first);
+	segment[1] = hash_page_ref(ctx, second);
+	ctx->dir->segments[0] = hash_page_ref(ctx, segment);
+	_hash_table_set_segment_generation(ctx, 0);
 
 	return true;
 }
 
 void hash_table_iterate_init(hash_ctx_t* ctx, hash_iteration_state_t* state) {
 	memset(state, 0, sizeof(hash_iteration_state_t));
+	state->ctx = ctx;
 	state->dir = ctx->dir;
 	state->version = ctx->dir->version;
-	// need to mark the buckets as unseen, so we'll not traverse the same bucket twice
-	// because it shows up multiple times in the directory
-	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++)
-	{
-		ctx->dir->buckets[i]->seen = false;
-	}
 }
 
 bool hash_table_iterate_next(hash_iteration_state_t* state, uint64_t* key, uint64_t* value) {
@@ -573,15 +2261,16 @@ bool hash_table_iterate_next(hash_iteration_state_t* state, uint64_t* key, uint6
 		if (state->current_piece_idx >= NUMBER_OF_HASH_BUCKET_PIECES) {
 			state->current_piece_idx = 0;
 			state->current_bucket_idx++;
-			if (state->dir->buckets[state->current_bucket_idx]->seen) {
-				// we'll now skip the already seen bucket
+			if (state->current_bucket_idx >= state->dir->number_of_buckets)
+				continue; // there is no slot past the last one to look at
+			// a bucket shows up in every slot that ends with its prefix, it is read at the first of them
+			hash_bucket_t* next = hash_directory_bucket(state->ctx, state->dir, state->current_bucket_idx);
+			if (state->current_bucket_idx >= ((size_t)1 << next->depth))
 				state->current_piece_idx = NUMBER_OF_HASH_BUCKET_PIECES;
-			}
-			state->dir->buckets[state->current_bucket_idx]->seen = true;
 			continue;
 		}
 
-		hash_bucket_t* b = state->dir->buckets[state->current_bucket_idx];
+		hash_bucket_t* b = hash_directory_bucket(state->ctx, state->dir, state->current_bucket_idx);
 		hash_bucket_piece_t* p = &b->pieces[state->current_piece_idx];
 		if (state->current_piece_byte_pos >= p->bytes_used) {
 			state->current_piece_byte_pos = 0;
@@ -590,8 +2279,9 @@ bool hash_table_iterate_next(hash_iteration_state_t* state, uint64_t* key, uint6
 		}
 
 		uint8_t* buf = p->data + state->current_piece_byte_pos;
-		varint_decode(&buf, key);
-		varint_decode(&buf, value);
+		_hash_table_read_key(state->ctx, &buf, key);
+		_hash_table_read_value(state->ctx, &buf, value);
+		*key = _hash_bucket_entry_key(state->ctx, b, *key);
 
 		state->current_piece_byte_pos = (uint8_t)(buf - p->data);
 
@@ -599,27 +2289,262 @@ bool hash_table_iterate_next(hash_iteration_state_t* state, uint64_t* key, uint6
 	}
 }
 
-int compare_ptrs(const void* a, const void* b) {
-	hash_bucket_t* x = *(hash_bucket_t**)a;
-	hash_bucket_t* y = *(hash_bucket_t**)b;
+// Scan: the cursor is a position in the order of the reversed hash bits. A bucket of depth d holds
+// the hashes with its d low bits, which reversed is a contiguous range, and the buckets' ranges
+// cover the whole order however the table was split or merged since. Each step returns the
+// bucket holding the cursor and moves the cursor to the end of its range, so a key that stays
+// in the table is in the bucket of some step (buckets merged since may come back in part).
+
+static inline uint64_t _hash_scan_reverse(uint64_t v) {
+	v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+	v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+	v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+	return __builtin_bswap64(v);
+}
+
+// the start of the range after the one of the depth bucket holding cursor, 0 past the last
+static inline uint64_t _hash_scan_next(uint64_t cursor, uint8_t depth) {
+	cursor |= ~(((uint64_t)1 << depth) - 1);
+	return _hash_scan_reverse(_hash_scan_reverse(cursor) + 1);
+}
+
+// the bucket holding cursor, copied to copy in concurrent mode so a writer can't change it
+// while we decode, must run inside an epoch
+static hash_bucket_t* _hash_table_scan_bucket(hash_ctx_t* ctx, uint64_t cursor, hash_bucket_t* copy) {
+	while (true) {
+		hash_directory_t* dir = __atomic_load_n(&ctx->dir, __ATOMIC_ACQUIRE);
+		uint8_t depth = __atomic_load_n(&dir->depth, __ATOMIC_ACQUIRE);
+		hash_bucket_t* b = hash_directory_bucket(ctx, dir, cursor & (((uint64_t)1 << depth) - 1));
+		if (!ctx->concurrent)
+			return b;
+
+		uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			_hash_cpu_relax();
+			continue;
+		}
+		memcpy(copy, b, sizeof(hash_bucket_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		dir = __atomic_load_n(&ctx->dir, __ATOMIC_ACQUIRE);
+		depth = __atomic_load_n(&dir->depth, __ATOMIC_ACQUIRE);
+		if (hash_directory_bucket(ctx, dir, cursor & (((uint64_t)1 << depth) - 1)) != b)
+			continue;
+		return copy;
+	}
+}
+
+// decodes the entries of b, returns how many
+static size_t _hash_table_scan_entries(hash_ctx_t* ctx, hash_bucket_t* b, uint64_t* keys, uint64_t* values) {
+	size_t count = 0;
+	for (size_t i = 0; i < NUMBER_OF_HASH_BUCKET_PIECES; i++)
+	{
+		uint8_t* buf = b->pieces[i].data;
+		uint8_t* end = buf + b->pieces[i].bytes_used;
+		while (buf < end)
+		{
+			_hash_table_read_key(ctx, &buf, &keys[count]);
+			_hash_table_read_value(ctx, &buf, &values[count]);
+			keys[count] = _hash_bucket_entry_key(ctx, b, keys[count]);
+			count++;
+		}
+	}
+	return count;
+}
+
+// the most entries a bucket of the table can hold
+static inline size_t _hash_table_scan_min_batch(hash_ctx_t* ctx) {
+	return ctx->layout == HASH_LAYOUT_KEYS ? HASH_SET_SCAN_MIN_BATCH : HASH_SCAN_MIN_BATCH;
+}
+
+size_t hash_table_scan(hash_ctx_t* ctx, uint64_t* cursor, uint64_t* keys, uint64_t* values, size_t n) {
+	if (n < _hash_table_scan_min_batch(ctx)) {
+		errno = EINVAL;
+		return 0;
+	}
+	hash_bucket_t* copy = NULL;
+	if (ctx->concurrent) {
+		copy = malloc(sizeof(hash_bucket_t));
+		if (!copy) {
+			errno = ENOMEM;
+			return 0;
+		}
+		if (!hash_epoch_enter()) {
+			free(copy);
+			errno = EBUSY;
+			return 0;
+		}
+	}
+
+	size_t count = 0;
+	do
+	{
+		hash_bucket_t* b = _hash_table_scan_bucket(ctx, *cursor, copy);
+		if (b->number_of_entries > n - count)
+			break;
+		count += _hash_table_scan_entries(ctx, b, keys + count, values + count);
+		*cursor = _hash_scan_next(*cursor, b->depth);
+	} while (*cursor);
+
+	if (ctx->concurrent) {
+		hash_epoch_exit();
+		free(copy);
+	}
+	return count;
+}
+
+hash_snapshot_t* hash_table_snapshot(hash_ctx_t* ctx) {
+	hash_snapshot_t* snap = malloc(sizeof(hash_snapshot_t));
+	if (!snap) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (ctx->snapshots_count == ctx->snapshots_capacity) {
+		uint32_t capacity = ctx->snapshots_capacity ? ctx->snapshots_capacity * 2 : 8;
+		uint32_t* snapshots = realloc(ctx->snapshots, capacity * sizeof(uint32_t));
+		if (!snapshots) {
+			free(snap);
+			errno = ENOMEM;
+			return NULL;
+		}
+		ctx->snapshots = snapshots;
+		ctx->snapshots_capacity = capacity;
+	}
+	snap->ctx = ctx;
+	snap->dir = ctx->dir;
+	snap->generation = ctx->dir->generation;
+	// the next write moves the table to a new generation, this one is frozen from now on
+	ctx->snapshots[ctx->snapshots_count++] = snap->generation;
+	return snap;
+}
+
+void hash_snapshot_release(hash_snapshot_t* snap) {
+	hash_ctx_t* ctx = snap->ctx;
+	for (uint32_t i = ctx->snapshots_count; i-- > 0;)
+	{
+		if (ctx->snapshots[i] != snap->generation)
+			continue;
+		memmove(&ctx->snapshots[i], &ctx->snapshots[i + 1], (ctx->snapshots_count - i - 1) * sizeof(uint32_t));
+		ctx->snapshots_count--;
+		break;
+	}
+	free(snap);
+
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < ctx->shared_count; i++)
+	{
+		hash_shared_page_t* shared = &ctx->shared[i];
+		if (_hash_table_snapshot_reads(ctx, shared->born, shared->dropped))
+			ctx->shared[kept++] = *shared;
+		else
+			_hash_table_retire_page(ctx, shared->page, shared->pages); // live readers may have it too
+	}
+	ctx->shared_count = kept;
+}
+
+bool hash_snapshot_get(hash_snapshot_t* snap, uint64_t key, uint64_t* value) {
+	// nothing in a snapshot changes or goes away while it is open, so no validation, and no
+	// counting either, the stats belong to the table's threads
+	uint64_t hash = _hash_table_hash(snap->ctx, key);
+	hash_bucket_t* b = hash_directory_bucket(snap->ctx, snap->dir, hash & (((uint64_t)1 << snap->dir->depth) - 1));
+	size_t scanned;
+	return _hash_table_lookup(snap->ctx, b, key, hash, value, &scanned);
+}
+
+size_t hash_snapshot_scan(hash_snapshot_t* snap, uint64_t* cursor, uint64_t* keys, uint64_t* values, size_t n) {
+	if (n < _hash_table_scan_min_batch(snap->ctx)) {
+		errno = EINVAL;
+		return 0;
+	}
+	size_t count = 0;
+	do
+	{
+		hash_bucket_t* b = hash_directory_bucket(snap->ctx, snap->dir, *cursor & (((uint64_t)1 << snap->dir->depth) - 1));
+		if (b->number_of_entries > n - count)
+			break;
+		count += _hash_table_scan_entries(snap->ctx, b, keys + count, values + count);
+		*cursor = _hash_scan_next(*cursor, b->depth);
+	} while (*cursor);
+	return count;
+}
 
-	ptrdiff_t diff = x - y;
-	if (diff)
-		return diff > 0 ? 1 : -1;
-	return 0;
+void hash_table_release_retired(hash_ctx_t* ctx) {
+	_hash_table_reclaim_pages(ctx, UINT64_MAX);
 }
 
 void hash_table_free(hash_ctx_t* ctx) {
-	qsort(ctx->dir->buckets, ctx->dir->number_of_buckets, sizeof(hash_bucket_t*), compare_ptrs);
-	hash_bucket_t* prev = NULL;
+	// there can be no readers by now, so anything still retired can go
+	hash_table_release_retired(ctx);
+	free(ctx->retired);
+	ctx->retired = NULL;
+	ctx->retired_capacity = 0;
+	free(ctx->snapshots);
+	free(ctx->shared);
+	free(ctx->segment_generations);
+	ctx->snapshots = NULL;
+	ctx->shared = NULL;
+	ctx->segment_generations = NULL;
+	ctx->snapshots_count = ctx->snapshots_capacity = 0;
+	ctx->shared_count = ctx->shared_capacity = 0;
+	ctx->segment_generations_capacity = 0;
+	free(ctx->compaction_candidates);
+	ctx->compaction_candidates = NULL;
+	ctx->compaction_count = ctx->compaction_capacity = 0;
+
+	_hash_table_release_directory(ctx, ctx->dir, false);
+	ctx->dir = NULL;
+}
+
+void hash_table_get_stats(hash_ctx_t* ctx, hash_stats_t* stats) {
+	memset(stats, 0, sizeof(hash_stats_t));
+#if HASH_STATS
+	// the counters are all the uint64_t fields before the gauges
+	uint64_t* sum = (uint64_t*)stats;
+	for (size_t s = 0; s < HASH_STATS_STRIPES; s++)
+	{
+		uint64_t* counters = (uint64_t*)&ctx->stats[s].stats;
+		for (size_t i = 0; i < offsetof(hash_stats_t, entries) / sizeof(uint64_t); i++)
+			sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+	}
+#endif
+
+	if (ctx->concurrent && !hash_epoch_enter()) {
+		errno = EBUSY;
+		return; // the directory may be released under us, so no gauges
+	}
+	hash_directory_t* dir = __atomic_load_n(&ctx->dir, __ATOMIC_ACQUIRE);
+	stats->entries = dir->number_of_entries;
+	stats->bytes_used = dir->bytes_used;
+	stats->bytes_allocated = ((uint64_t)dir->number_of_bucket_pages + dir->directory_pages + dir->segment_pages) * HASH_BUCKET_PAGE_SIZE;
+	stats->depth = dir->depth;
+	if (ctx->concurrent)
+		hash_epoch_exit();
+}
+
+double hash_table_filter_false_positive_rate(hash_ctx_t* ctx) {
+#if HASH_BUCKET_FILTER_LINES
+	// a missing key lands on each slot with the same chance, and gets through a line with
+	// the chance that all of its bits are set, that is the fraction of set bits to the power of the hashes
+	double total = 0;
 	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++)
 	{
-		if (prev == ctx->dir->buckets[i]) {
-			continue;
+		hash_bucket_t* b = hash_directory_bucket(ctx, ctx->dir, i);
+		double bucket = 0;
+		for (size_t line = 0; line < HASH_BUCKET_FILTER_LINES; line++)
+		{
+			uint32_t set = 0;
+			for (size_t w = 0; w < 8; w++)
+				set += __builtin_popcountll(b->filter[line * 8 + w]);
+			double pass = 1;
+			for (int h = 0; h < HASH_BUCKET_FILTER_HASHES; h++)
+				pass *= set / 512.0;
+			bucket += pass;
 		}
-		prev = ctx->dir->buckets[i];
-		ctx->release_page(ctx->dir->buckets[i]);
+		total += bucket / HASH_BUCKET_FILTER_LINES;
 	}
-	ctx->release_page(ctx->dir);
-	ctx->dir = NULL;
+	return total / ctx->dir->number_of_buckets;
+#else
+	return 1;
+#endif
 }
\ No newline at end of file
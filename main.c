@@ -1,30 +1,193 @@
 ﻿#include <stdlib.h>
 #include <stdio.h>
-#include <malloc.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
-#include "wyhash.h" //https://raw.githubusercontent.com/wangyi-fudan/wymlp/master/wyhash.h
 #include "ehash.h"
 
 
 int allocations = 0;
 
-void* allocate_4k_page(uint32_t n) {
+// wyrand, https://github.com/wangyi-fudan/wyhash
+static uint64_t wyseed = 0;
+
+uint64_t wygrand(void) {
+	wyseed += 0xa0761d6478bd642full;
+	__uint128_t m = (__uint128_t)wyseed * (wyseed ^ 0xe7037ed1a0b428dbull);
+	return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+void* allocate_4k_page(hash_ctx_t* ctx, uint32_t n) {
 	allocations++;
-	return _aligned_malloc(HASH_BUCKET_PAGE_SIZE * n, HASH_BUCKET_PAGE_SIZE);
+	return aligned_alloc(HASH_BUCKET_PAGE_SIZE, (size_t)HASH_BUCKET_PAGE_SIZE * n);
 }
 
-void release_4k_page(void* p) {	 
+void release_4k_page(hash_ctx_t* ctx, void* p, uint32_t n) {	 
 	if (!p)
 		return;
 	allocations--;
-	_aligned_free(p);
+	free(p);
 }
 
-int main()
+// compares a loop of hash_table_get against hash_table_get_batch, the table should be
+// much larger than the LLC for the difference to show, hence the default of 16M entries
+int bench_get_batch(uint32_t size, uint32_t batch_size) {
+	uint64_t* keys = malloc(size * sizeof(uint64_t));
+	uint64_t* values = malloc(batch_size * sizeof(uint64_t));
+	uint64_t* found = malloc(((batch_size + 63) / 64) * sizeof(uint64_t));
+	if (!keys || !values || !found)
+		return -1;
+
+	struct hash_ctx ctx = { allocate_4k_page, release_4k_page };
+	if (!hash_table_init(&ctx)) {
+		printf("Failed to init\n");
+		return -1;
+	}
+	for (size_t i = 0; i < size; i++)
+	{
+		keys[i] = wygrand();
+		if (!hash_table_put(&ctx, keys[i], i)) {
+			printf("Failed to put %zu\n", i);
+			return -1;
+		}
+	}
+	// shuffle the lookup order, so we aren't walking the table in insertion order
+	for (size_t i = size - 1; i > 0; i--)
+	{
+		size_t j = wygrand() % (i + 1);
+		uint64_t tmp = keys[i];
+		keys[i] = keys[j];
+		keys[j] = tmp;
+	}
+
+	clock_t start = clock();
+	uint64_t single_found = 0;
+	for (size_t i = 0; i < size; i++)
+	{
+		uint64_t v;
+		single_found += hash_table_get(&ctx, keys[i], &v);
+	}
+	double single = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	start = clock();
+	uint64_t batch_found = 0;
+	for (size_t i = 0; i < size; i += batch_size)
+	{
+		size_t n = size - i < batch_size ? size - i : batch_size;
+		batch_found += hash_table_get_batch(&ctx, keys + i, n, values, found);
+	}
+	double batch = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("entries: %u, pages: %i, single: %.1f ns/key (%" PRIu64 " found), batch of %u: %.1f ns/key (%" PRIu64 " found)\n",
+		size, allocations, single * 1e9 / size, single_found, batch_size, batch * 1e9 / size, batch_found);
+
+	hash_table_free(&ctx);
+	free(found);
+	free(values);
+	free(keys);
+	return 0;
+}
+
+// the pieces a get reads, walked the way it walks them: from the key's own piece on, past the
+// overflowed ones. A hit stops at its entry, a miss the filter lets through at the first piece
+// that never overflowed. Misses are weighed by directory slot, as their keys are.
+typedef struct probe_lengths {
+	uint32_t max_hit;
+	uint32_t max_miss;
+	double avg_hit;
+	double avg_miss;
+} probe_lengths_t;
+
+static void probe_lengths(hash_ctx_t* ctx, probe_lengths_t* probes) {
+	uint64_t hit_sum = 0, hits = 0, miss_sum = 0, misses = 0;
+	memset(probes, 0, sizeof(*probes));
+	for (size_t i = 0; i < ctx->dir->number_of_buckets; i++)
+	{
+		hash_bucket_t* b = hash_directory_bucket(ctx, ctx->dir, i);
+		for (uint32_t j = 0; j < NUMBER_OF_HASH_BUCKET_PIECES; j++)
+		{
+			uint32_t len = 1;
+			while (len < NUMBER_OF_HASH_BUCKET_PIECES && b->pieces[(j + len - 1) % NUMBER_OF_HASH_BUCKET_PIECES].overflowed)
+				len++;
+			miss_sum += len;
+			misses++;
+			if (len > probes->max_miss)
+				probes->max_miss = len;
+
+			if (i >= ((size_t)1 << b->depth))
+				continue; // its entries are counted at its first slot
+			// the varint layout, the keys as they were put
+			uint8_t* buf = b->pieces[j].data;
+			uint8_t* end = buf + b->pieces[j].bytes_used;
+			while (buf < end)
+			{
+				uint64_t k, v;
+				varint_decode(&buf, &k);
+				varint_decode(&buf, &v);
+				uint32_t home = hash_key_mix(ctx->mix, k) % NUMBER_OF_HASH_BUCKET_PIECES;
+				uint32_t hit = (j + NUMBER_OF_HASH_BUCKET_PIECES - home) % NUMBER_OF_HASH_BUCKET_PIECES + 1;
+				hit_sum += hit;
+				hits++;
+				if (hit > probes->max_hit)
+					probes->max_hit = hit;
+			}
+		}
+	}
+	probes->avg_hit = hits ? (double)hit_sum / hits : 0;
+	probes->avg_miss = misses ? (double)miss_sum / misses : 0;
+}
+
+// inserts sequential, aligned (low bits all zero) and random keys with each of the key mixers,
+// and reports how big the directory got and how many pieces a get reads
+int bench_key_mix(uint32_t size) {
+	const char* mixes[] = { "identity", "multiply", "wyhash" };
+	const char* patterns[] = { "sequential", "aligned", "random" };
+
+	for (uint8_t mix = HASH_MIX_IDENTITY; mix <= HASH_MIX_WYHASH; mix++)
+	{
+		for (int pattern = 0; pattern < 3; pattern++)
+		{
+			allocations = 0;
+			struct hash_ctx ctx = { allocate_4k_page, release_4k_page };
+			ctx.mix = mix;
+			if (!hash_table_init(&ctx)) {
+				printf("Failed to init\n");
+				return -1;
+			}
+
+			clock_t start = clock();
+			for (uint64_t i = 0; i < size; i++)
+			{
+				uint64_t key = pattern == 0 ? i : pattern == 1 ? i << 8 : wygrand();
+				if (!hash_table_put(&ctx, key, i)) {
+					printf("Failed to put %" PRIu64 "\n", i);
+					return -1;
+				}
+			}
+			double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+			probe_lengths_t probes;
+			probe_lengths(&ctx, &probes);
+			printf("mix: %s, keys: %s, entries: %u, depth: %u, directory pages: %u, pages: %i, hit probe: max %u avg %.2f, miss probe: max %u avg %.2f, put: %.1f ns\n",
+				mixes[mix], patterns[pattern], size, ctx.dir->depth, ctx.dir->directory_pages, allocations,
+				probes.max_hit, probes.avg_hit, probes.max_miss, probes.avg_miss, elapsed * 1e9 / size);
+			hash_table_free(&ctx);
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
 {
+	if (argc > 1 && strcmp(argv[1], "get-batch") == 0)
+		return bench_get_batch(argc > 2 ? atoi(argv[2]) : 16 * 1024 * 1024, argc > 3 ? atoi(argv[3]) : 64);
+	if (argc > 1 && strcmp(argv[1], "key-mix") == 0)
+		return bench_key_mix(argc > 2 ? atoi(argv[2]) : 1024 * 1024);
+	
 	
 	uint32_t const size = 686;
 
@@ -57,7 +220,7 @@ int main()
 	for (size_t i = 0; i < size; i++)
 	{
 		if (!hash_table_put(&ctx, keys[i], values[i])) {
-			printf("Failed to put %llu\n", i);
+			printf("Failed to put %zu\n", i);
 			write_dir_graphviz(&ctx, "PUT-ERR");
 			return -1;
 		}
@@ -67,12 +230,59 @@ int main()
 #if VALIDATE
 		uint64_t v;
 		if (!hash_table_get(&ctx, first_key, &v) || v != first_value) {
-			printf("Failed to get 0 on %llu\n", i);
+			printf("Failed to get 0 on %zu\n", i);
 			write_dir_graphviz(&ctx, "PUT-ERR");
 		}
 #endif
 	}
 
+#if VALIDATE
+	// saved and loaded read only, every key reads back and the writes fail without touching it
+	char path[] = "/tmp/ehash-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || !hash_table_save(&ctx, fd)) {
+		printf("Failed to save\n");
+		return -1;
+	}
+	close(fd);
+	struct hash_ctx loaded = { 0 };
+	if (!hash_table_load_mmap(&loaded, path)) {
+		printf("Failed to load\n");
+		return -1;
+	}
+	for (size_t i = 0; i < size; i++)
+	{
+		uint64_t v, expected;
+		if (!hash_table_get(&ctx, keys[i], &expected) || !hash_table_get(&loaded, keys[i], &v) || v != expected) {
+			printf("Failed to get %zu from the loaded table\n", i);
+			return -1;
+		}
+	}
+	size_t iterated = 0;
+	uint64_t loaded_key, loaded_value;
+	hash_iteration_state_t loaded_state;
+	hash_table_iterate_init(&loaded, &loaded_state);
+	while (hash_table_iterate_next(&loaded_state, &loaded_key, &loaded_value)) {
+		uint64_t expected;
+		if (!hash_table_get(&ctx, loaded_key, &expected) || loaded_value != expected) {
+			printf("Iterated %llu, which the table doesn't hold\n", (unsigned long long)loaded_key);
+			return -1;
+		}
+		iterated++;
+	}
+	if (iterated != ctx.dir->number_of_entries) {
+		printf("Iterated %zu of %llu entries of the loaded table\n", iterated, (unsigned long long)ctx.dir->number_of_entries);
+		return -1;
+	}
+	if (hash_table_put(&loaded, keys[0], 0) || errno != EROFS ||
+		hash_table_delete(&loaded, keys[0], NULL) || errno != EROFS) {
+		printf("Wrote to the loaded table\n");
+		return -1;
+	}
+	hash_table_close_file(&loaded);
+	unlink(path);
+#endif
+
 	//for (size_t i = 0; i < 100; i++)
 	//{
 	//	if (!(keys[i] & 1)) {
@@ -86,7 +296,7 @@ int main()
 
 	//write_dir_graphviz(&ctx, "DEL");
 	hash_table_free(&ctx);
-	return;
+	return 0;
 }
 
 
@@ -0,0 +1,236 @@
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "ehash.h"
+
+// Pages carved out of HASH_POOL_REGION_SIZE regions, which are backed by huge pages when the
+// system has them (MAP_HUGETLB, or transparent huge pages otherwise), so the buckets of a large
+// table need a TLB entry per region instead of one per few pages. A released page goes to the
+// cache of the releasing thread and is handed out again from there, a cache that grows past
+// HASH_POOL_CACHE_PAGES gives half of it back to the shared free list. Runs of pages (the
+// directory) are carved from a region in one piece, or mapped on their own when larger.
+
+#define HASH_POOL_REGION_PAGES	(HASH_POOL_REGION_SIZE / HASH_BUCKET_PAGE_SIZE)
+
+typedef struct hash_pool_cache {
+	_Alignas(64) void* head; // free pages, linked through their first 8 bytes
+	uint32_t count;
+} hash_pool_cache_t;
+
+struct hash_pool {
+	uint32_t lock;
+	bool no_hugetlb; // MAP_HUGETLB failed once, no point in trying it again
+	void* free_list;
+	uint8_t* region; // where new pages are carved from
+	uint32_t region_used;
+	uint32_t regions_count;
+	uint32_t regions_capacity;
+	uint8_t** regions; // all the regions, for hash_pool_destroy
+	hash_pool_cache_t caches[HASH_EPOCH_MAX_THREADS]; // by epoch slot
+};
+
+static inline void _hash_pool_lock(hash_pool_t* pool) {
+	while (true) {
+		if (!__atomic_load_n(&pool->lock, __ATOMIC_RELAXED) &&
+			!__atomic_exchange_n(&pool->lock, 1, __ATOMIC_ACQUIRE))
+			return;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+}
+
+static inline void _hash_pool_unlock(hash_pool_t* pool) {
+	__atomic_store_n(&pool->lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline size_t _hash_pool_run_size(uint32_t n) {
+	size_t size = (size_t)n * HASH_BUCKET_PAGE_SIZE;
+	return (size + HASH_POOL_REGION_SIZE - 1) & ~((size_t)HASH_POOL_REGION_SIZE - 1);
+}
+
+// maps size bytes (a multiple of the region size) aligned to the region size, called locked
+static void* _hash_pool_map(hash_pool_t* pool, size_t size) {
+#ifdef MAP_HUGETLB
+	if (!pool->no_hugetlb) {
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+		if (HASH_POOL_REGION_SIZE == 2 * 1024 * 1024)
+			flags |= MAP_HUGE_2MB; // not the system's default huge page size, which may be larger
+#endif
+		void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (p != MAP_FAILED)
+			return p;
+		pool->no_hugetlb = true; // usually no huge pages were reserved
+	}
+#endif
+	// the kernel can only back aligned ranges with transparent huge pages, so we map a region
+	// more than needed and trim it to the alignment
+	uint8_t* raw = mmap(NULL, size + HASH_POOL_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		return NULL;
+	uint8_t* p = (uint8_t*)(((uintptr_t)raw + HASH_POOL_REGION_SIZE - 1) & ~(uintptr_t)(HASH_POOL_REGION_SIZE - 1));
+	if (p != raw)
+		munmap(raw, p - raw);
+	if (p + size != raw + size + HASH_POOL_REGION_SIZE)
+		munmap(p + size, raw + HASH_POOL_REGION_SIZE - p);
+#ifdef MADV_HUGEPAGE
+	madvise(p, size, MADV_HUGEPAGE);
+#endif
+	return p;
+}
+
+// n contiguous pages from the current region, starting a new one if they don't fit, called locked
+static void* _hash_pool_carve(hash_pool_t* pool, uint32_t n) {
+	if (!pool->region || pool->region_used + n > HASH_POOL_REGION_PAGES) {
+		if (pool->regions_count == pool->regions_capacity) {
+			uint32_t capacity = pool->regions_capacity ? pool->regions_capacity * 2 : 64;
+			uint8_t** regions = realloc(pool->regions, capacity * sizeof(uint8_t*));
+			if (!regions)
+				return NULL;
+			pool->regions = regions;
+			pool->regions_capacity = capacity;
+		}
+		uint8_t* region = _hash_pool_map(pool, HASH_POOL_REGION_SIZE);
+		if (!region)
+			return NULL;
+		// what is left of the old region isn't lost, it goes to the free list
+		for (; pool->region && pool->region_used < HASH_POOL_REGION_PAGES; pool->region_used++)
+		{
+			void* page = pool->region + (size_t)pool->region_used * HASH_BUCKET_PAGE_SIZE;
+			*(void**)page = pool->free_list;
+			pool->free_list = page;
+		}
+		pool->regions[pool->regions_count++] = region;
+		pool->region = region;
+		pool->region_used = 0;
+	}
+	void* p = pool->region + (size_t)pool->region_used * HASH_BUCKET_PAGE_SIZE;
+	pool->region_used += n;
+	return p;
+}
+
+static inline hash_pool_cache_t* _hash_pool_cache(hash_pool_t* pool) {
+	int32_t slot = hash_epoch_thread_slot();
+	return slot < 0 ? NULL : &pool->caches[slot];
+}
+
+// fills an empty cache with half its capacity, from the free list or a region
+static void _hash_pool_refill(hash_pool_t* pool, hash_pool_cache_t* cache) {
+	_hash_pool_lock(pool);
+	while (cache->count < HASH_POOL_CACHE_PAGES / 2)
+	{
+		void* page = pool->free_list;
+		if (page)
+			pool->free_list = *(void**)page;
+		else if (!(page = _hash_pool_carve(pool, 1)))
+			break;
+		*(void**)page = cache->head;
+		cache->head = page;
+		cache->count++;
+	}
+	_hash_pool_unlock(pool);
+}
+
+// gives the oldest half of a full cache back to the free list
+static void _hash_pool_drain(hash_pool_t* pool, hash_pool_cache_t* cache) {
+	void* last = cache->head;
+	for (uint32_t i = 1; i < HASH_POOL_CACHE_PAGES / 2; i++)
+		last = *(void**)last;
+	void* drained = *(void**)last;
+	*(void**)last = NULL;
+	cache->count = HASH_POOL_CACHE_PAGES / 2;
+
+	void* tail = drained;
+	while (*(void**)tail)
+		tail = *(void**)tail;
+	_hash_pool_lock(pool);
+	*(void**)tail = pool->free_list;
+	pool->free_list = drained;
+	_hash_pool_unlock(pool);
+}
+
+hash_pool_t* hash_pool_create(void) {
+	hash_pool_t* pool = aligned_alloc(_Alignof(hash_pool_t), sizeof(hash_pool_t));
+	if (!pool) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(pool, 0, sizeof(hash_pool_t));
+	return pool;
+}
+
+void hash_pool_destroy(hash_pool_t* pool) {
+	for (uint32_t i = 0; i < pool->regions_count; i++)
+		munmap(pool->regions[i], HASH_POOL_REGION_SIZE);
+	free(pool->regions);
+	free(pool);
+}
+
+void* hash_pool_allocate_page(hash_ctx_t* ctx, uint32_t n) {
+	hash_pool_t* pool = ctx->page_state;
+	void* p = NULL;
+
+	if (n == 1) {
+		hash_pool_cache_t* cache = _hash_pool_cache(pool);
+		if (cache && !cache->head)
+			_hash_pool_refill(pool, cache);
+		if (cache && cache->head) {
+			p = cache->head;
+			cache->head = *(void**)p;
+			cache->count--;
+			return p;
+		}
+		// no epoch slot left for this thread, it takes the slow path every time
+	}
+
+	_hash_pool_lock(pool);
+	if (n > HASH_POOL_REGION_PAGES) {
+		p = _hash_pool_map(pool, _hash_pool_run_size(n));
+	}
+	else if (n == 1 && pool->free_list) {
+		p = pool->free_list;
+		pool->free_list = *(void**)p;
+	}
+	else {
+		p = _hash_pool_carve(pool, n);
+	}
+	_hash_pool_unlock(pool);
+	if (!p)
+		errno = ENOMEM;
+	return p;
+}
+
+void hash_pool_release_page(hash_ctx_t* ctx, void* p, uint32_t n) {
+	hash_pool_t* pool = ctx->page_state;
+	if (!p)
+		return;
+
+	if (n > HASH_POOL_REGION_PAGES) {
+		munmap(p, _hash_pool_run_size(n));
+		return;
+	}
+
+	hash_pool_cache_t* cache = n == 1 ? _hash_pool_cache(pool) : NULL;
+	if (cache) {
+		*(void**)p = cache->head;
+		cache->head = p;
+		if (++cache->count > HASH_POOL_CACHE_PAGES)
+			_hash_pool_drain(pool, cache);
+		return;
+	}
+
+	// a released run is broken into single pages, they are reused as buckets
+	_hash_pool_lock(pool);
+	for (uint32_t i = 0; i < n; i++)
+	{
+		void* page = (uint8_t*)p + (size_t)i * HASH_BUCKET_PAGE_SIZE;
+		*(void**)page = pool->free_list;
+		pool->free_list = page;
+	}
+	_hash_pool_unlock(pool);
+}
@@ -0,0 +1,283 @@
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "ehash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HASH_SCAN_X86 1
+#endif
+
+// A piece is a sequence of [varint key][varint value] entries. The vector kernels load the
+// whole 64 bytes of the piece, get the continuation bits of every byte with a single movemask
+// and derive from them where each key starts, then compare the encoded key against all the
+// positions at once. The bit masks below are indexed by the position in p->data, which is
+// the piece byte position shifted down by one (the first byte holds overflowed / bytes_used).
+// The fixed layouts use the same kernels minus the varint decoding: the keys start every
+// entry_size bytes, and all 8 bytes of the key are compared at each of those positions. In a
+// piece of a set every varint is a key, a key starts wherever the byte before it ends one.
+
+static inline uint64_t _prefix_xor(uint64_t x) {
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+static inline uint64_t _valid_mask(const hash_bucket_piece_t* p) {
+	uint32_t used = p->bytes_used;
+	if (used > PIECE_BUCKET_BUFFER_SIZE)
+		used = PIECE_BUCKET_BUFFER_SIZE; // can only happen on a torn read, the caller will retry
+	return ((uint64_t)1 << used) - 1;
+}
+
+// given the continuation bits of the piece, return the positions in which a key starts
+static inline uint64_t _key_starts(uint64_t continuations, uint64_t valid) {
+	uint64_t terminators = ~continuations & valid;
+	// a byte belongs to a key if the number of varints that ended before it is even
+	uint64_t keys = ~_prefix_xor(terminators << 1) & valid;
+	return keys & ~(keys << 1);
+}
+
+static inline uint64_t _set_key_starts(uint64_t continuations, uint64_t valid) {
+	uint64_t terminators = ~continuations & valid;
+	return ((terminators << 1) | 1) & valid;
+}
+
+static inline uint64_t _varint_key_starts(uint64_t continuations, uint64_t valid, bool keys_only) {
+	return keys_only ? _set_key_starts(continuations, valid) : _key_starts(continuations, valid);
+}
+
+// the positions in which a key of a fixed layout starts
+static inline uint64_t _fixed_key_starts(uint8_t entry_size, uint64_t valid) {
+	uint64_t starts = 0;
+	for (uint32_t i = 0; i + entry_size <= PIECE_BUCKET_BUFFER_SIZE; i += entry_size)
+		starts |= (uint64_t)1 << i;
+	return starts & valid;
+}
+
+static inline bool _first_match(uint64_t matches, uint8_t* offset) {
+	if (!matches)
+		return false;
+	*offset = (uint8_t)__builtin_ctzll(matches);
+	return true;
+}
+
+// keys_only is a constant in each caller, so the kernels of both varint layouts come out of one body
+static inline bool _piece_find_scalar_varint(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset, bool keys_only) {
+	const uint8_t* buf = p->data;
+	const uint8_t* end = p->data + p->bytes_used;
+	while (buf < end)
+	{
+		const uint8_t* start = buf;
+		while (*buf++ & 0x80); // key
+		bool matched = buf - start == key_size && memcmp(start, key, key_size) == 0;
+		if (!keys_only)
+			while (*buf++ & 0x80); // value
+		if (matched) {
+			*offset = (uint8_t)(start - p->data);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool _piece_find_scalar(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	return _piece_find_scalar_varint(p, key, key_size, offset, false);
+}
+
+static bool _piece_find_keys_scalar(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	return _piece_find_scalar_varint(p, key, key_size, offset, true);
+}
+
+static bool _piece_find_fixed_scalar(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t entry_size, uint8_t* offset) {
+	uint64_t k;
+	memcpy(&k, key, sizeof(k));
+	uint32_t used = p->bytes_used < PIECE_BUCKET_BUFFER_SIZE ? p->bytes_used : PIECE_BUCKET_BUFFER_SIZE;
+	for (uint32_t i = 0; i + entry_size <= used; i += entry_size)
+	{
+		uint64_t stored;
+		memcpy(&stored, p->data + i, sizeof(stored));
+		if (stored == k) {
+			*offset = (uint8_t)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+#if HASH_SCAN_X86
+
+__attribute__((target("sse4.2"), always_inline))
+static inline bool _piece_find_sse_varint(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset, bool keys_only) {
+	const __m128i* src = (const __m128i*)p;
+	__m128i v0 = _mm_loadu_si128(src + 0);
+	__m128i v1 = _mm_loadu_si128(src + 1);
+	__m128i v2 = _mm_loadu_si128(src + 2);
+	__m128i v3 = _mm_loadu_si128(src + 3);
+
+#define MASK64(a, b, c, d) ( (uint64_t)(uint16_t)_mm_movemask_epi8(a) \
+		| ((uint64_t)(uint16_t)_mm_movemask_epi8(b) << 16) \
+		| ((uint64_t)(uint16_t)_mm_movemask_epi8(c) << 32) \
+		| ((uint64_t)(uint16_t)_mm_movemask_epi8(d) << 48))
+
+	uint64_t matches = _varint_key_starts(MASK64(v0, v1, v2, v3) >> 1, _valid_mask(p), keys_only);
+	for (uint8_t i = 0; i < key_size && matches; i++)
+	{
+		__m128i k = _mm_set1_epi8((char)key[i]);
+		uint64_t eq = MASK64(_mm_cmpeq_epi8(v0, k), _mm_cmpeq_epi8(v1, k), _mm_cmpeq_epi8(v2, k), _mm_cmpeq_epi8(v3, k));
+		matches &= eq >> (i + 1);
+	}
+#undef MASK64
+	return _first_match(matches, offset);
+}
+
+__attribute__((target("sse4.2")))
+static bool _piece_find_sse(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	return _piece_find_sse_varint(p, key, key_size, offset, false);
+}
+
+__attribute__((target("sse4.2")))
+static bool _piece_find_keys_sse(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	return _piece_find_sse_varint(p, key, key_size, offset, true);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline bool _piece_find_avx2_varint(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset, bool keys_only) {
+	const __m256i* src = (const __m256i*)p;
+	__m256i lo = _mm256_loadu_si256(src);
+	__m256i hi = _mm256_loadu_si256(src + 1);
+
+#define MASK64(a, b) ((uint64_t)(uint32_t)_mm256_movemask_epi8(a) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32))
+
+	uint64_t matches = _varint_key_starts(MASK64(lo, hi) >> 1, _valid_mask(p), keys_only);
+	for (uint8_t i = 0; i < key_size && matches; i++)
+	{
+		__m256i k = _mm256_set1_epi8((char)key[i]);
+		matches &= MASK64(_mm256_cmpeq_epi8(lo, k), _mm256_cmpeq_epi8(hi, k)) >> (i + 1);
+	}
+#undef MASK64
+	return _first_match(matches, offset);
+}
+
+__attribute__((target("avx2")))
+static bool _piece_find_avx2(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	return _piece_find_avx2_varint(p, key, key_size, offset, false);
+}
+
+__attribute__((target("avx2")))
+static bool _piece_find_keys_avx2(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	return _piece_find_avx2_varint(p, key, key_size, offset, true);
+}
+
+__attribute__((target("sse4.2")))
+static bool _piece_find_fixed_sse(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t entry_size, uint8_t* offset) {
+	const __m128i* src = (const __m128i*)p;
+	__m128i v0 = _mm_loadu_si128(src + 0);
+	__m128i v1 = _mm_loadu_si128(src + 1);
+	__m128i v2 = _mm_loadu_si128(src + 2);
+	__m128i v3 = _mm_loadu_si128(src + 3);
+
+#define MASK64(a, b, c, d) ( (uint64_t)(uint16_t)_mm_movemask_epi8(a) \
+		| ((uint64_t)(uint16_t)_mm_movemask_epi8(b) << 16) \
+		| ((uint64_t)(uint16_t)_mm_movemask_epi8(c) << 32) \
+		| ((uint64_t)(uint16_t)_mm_movemask_epi8(d) << 48))
+
+	uint64_t matches = _fixed_key_starts(entry_size, _valid_mask(p));
+	for (uint8_t i = 0; i < 8 && matches; i++)
+	{
+		__m128i k = _mm_set1_epi8((char)key[i]);
+		uint64_t eq = MASK64(_mm_cmpeq_epi8(v0, k), _mm_cmpeq_epi8(v1, k), _mm_cmpeq_epi8(v2, k), _mm_cmpeq_epi8(v3, k));
+		matches &= eq >> (i + 1);
+	}
+#undef MASK64
+	return _first_match(matches, offset);
+}
+
+__attribute__((target("avx2")))
+static bool _piece_find_fixed_avx2(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t entry_size, uint8_t* offset) {
+	const __m256i* src = (const __m256i*)p;
+	__m256i lo = _mm256_loadu_si256(src);
+	__m256i hi = _mm256_loadu_si256(src + 1);
+
+#define MASK64(a, b) ((uint64_t)(uint32_t)_mm256_movemask_epi8(a) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32))
+
+	uint64_t matches = _fixed_key_starts(entry_size, _valid_mask(p));
+	for (uint8_t i = 0; i < 8 && matches; i++)
+	{
+		__m256i k = _mm256_set1_epi8((char)key[i]);
+		matches &= MASK64(_mm256_cmpeq_epi8(lo, k), _mm256_cmpeq_epi8(hi, k)) >> (i + 1);
+	}
+#undef MASK64
+	return _first_match(matches, offset);
+}
+
+#endif
+
+static bool _piece_find_resolve(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset);
+
+static bool _piece_find_keys_resolve(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset);
+
+static bool _piece_find_fixed_resolve(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t entry_size, uint8_t* offset);
+
+static bool (*_piece_find)(const hash_bucket_piece_t*, const uint8_t*, uint8_t, uint8_t*) = _piece_find_resolve;
+
+static bool (*_piece_find_keys)(const hash_bucket_piece_t*, const uint8_t*, uint8_t, uint8_t*) = _piece_find_keys_resolve;
+
+static bool (*_piece_find_fixed)(const hash_bucket_piece_t*, const uint8_t*, uint8_t, uint8_t*) = _piece_find_fixed_resolve;
+
+static bool _piece_find_resolve(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	hash_piece_scan_select(HASH_PIECE_SCAN_AUTO);
+	return _piece_find(p, key, key_size, offset);
+}
+
+static bool _piece_find_keys_resolve(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	hash_piece_scan_select(HASH_PIECE_SCAN_AUTO);
+	return _piece_find_keys(p, key, key_size, offset);
+}
+
+static bool _piece_find_fixed_resolve(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t entry_size, uint8_t* offset) {
+	hash_piece_scan_select(HASH_PIECE_SCAN_AUTO);
+	return _piece_find_fixed(p, key, entry_size, offset);
+}
+
+hash_piece_scan_t hash_piece_scan_select(hash_piece_scan_t kind) {
+#if HASH_SCAN_X86
+	__builtin_cpu_init();
+	if (kind == HASH_PIECE_SCAN_AUTO)
+		kind = __builtin_cpu_supports("avx2") ? HASH_PIECE_SCAN_AVX2 :
+			__builtin_cpu_supports("sse4.2") ? HASH_PIECE_SCAN_SSE42 : HASH_PIECE_SCAN_SCALAR;
+	if (kind == HASH_PIECE_SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+		_piece_find = _piece_find_avx2;
+		_piece_find_keys = _piece_find_keys_avx2;
+		_piece_find_fixed = _piece_find_fixed_avx2;
+		return kind;
+	}
+	if (kind == HASH_PIECE_SCAN_SSE42 && __builtin_cpu_supports("sse4.2")) {
+		_piece_find = _piece_find_sse;
+		_piece_find_keys = _piece_find_keys_sse;
+		_piece_find_fixed = _piece_find_fixed_sse;
+		return kind;
+	}
+#endif
+	_piece_find = _piece_find_scalar;
+	_piece_find_keys = _piece_find_keys_scalar;
+	_piece_find_fixed = _piece_find_fixed_scalar;
+	return HASH_PIECE_SCAN_SCALAR;
+}
+
+bool hash_piece_find(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	return _piece_find(p, key, key_size, offset);
+}
+
+bool hash_piece_find_keys(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t key_size, uint8_t* offset) {
+	return _piece_find_keys(p, key, key_size, offset);
+}
+
+bool hash_piece_find_fixed(const hash_bucket_piece_t* p, const uint8_t* key, uint8_t entry_size, uint8_t* offset) {
+	return _piece_find_fixed(p, key, entry_size, offset);
+}
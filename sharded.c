@@ -0,0 +1,201 @@
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "ehash.h"
+
+// The shards are independent tables, each with its own writer lock, directory and splits.
+// The shard is chosen by the high bits of the mixed key, the tables route by the low bits, so
+// the two don't interfere. Every shard runs in concurrent mode, readers never take locks.
+
+static inline uint32_t _hash_sharded_shard_number(hash_sharded_ctx_t* ctx, uint64_t key) {
+	return ctx->shard_bits ? (uint32_t)(hash_key_mix(ctx->mix, key) >> (64 - ctx->shard_bits)) : 0;
+}
+
+static inline void _hash_shard_lock(hash_shard_t* shard) {
+	while (true) {
+		if (!__atomic_load_n(&shard->lock, __ATOMIC_RELAXED) &&
+			!__atomic_exchange_n(&shard->lock, 1, __ATOMIC_ACQUIRE))
+			return;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+}
+
+static inline void _hash_shard_unlock(hash_shard_t* shard) {
+	__atomic_store_n(&shard->lock, 0, __ATOMIC_RELEASE);
+}
+
+bool hash_sharded_init(hash_sharded_ctx_t* ctx, uint8_t shard_bits) {
+	if (shard_bits > HASH_SHARDED_MAX_BITS)
+		return false;
+
+	uint32_t count = (uint32_t)1 << shard_bits;
+	ctx->shard_bits = shard_bits;
+	ctx->shards = aligned_alloc(_Alignof(hash_shard_t), count * sizeof(hash_shard_t));
+	if (!ctx->shards)
+		return false;
+	memset(ctx->shards, 0, count * sizeof(hash_shard_t));
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		hash_ctx_t* shard = &ctx->shards[i].ctx;
+		shard->allocate_page = ctx->allocate_page;
+		shard->release_page = ctx->release_page;
+		shard->page_state = ctx->page_state;
+		shard->mix = ctx->mix;
+		shard->compress_keys = ctx->compress_keys;
+		shard->layout = ctx->layout;
+		shard->concurrent = true;
+		if (!hash_table_init(shard)) {
+			while (i--)
+				hash_table_free(&ctx->shards[i].ctx);
+			free(ctx->shards);
+			ctx->shards = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+void hash_sharded_free(hash_sharded_ctx_t* ctx) {
+	for (uint32_t i = 0; i < ((uint32_t)1 << ctx->shard_bits); i++)
+	{
+		hash_table_free(&ctx->shards[i].ctx);
+	}
+	free(ctx->shards);
+	ctx->shards = NULL;
+}
+
+bool hash_sharded_get(hash_sharded_ctx_t* ctx, uint64_t key, uint64_t* value) {
+	return hash_table_get(&ctx->shards[_hash_sharded_shard_number(ctx, key)].ctx, key, value);
+}
+
+bool hash_sharded_put(hash_sharded_ctx_t* ctx, uint64_t key, uint64_t value) {
+	hash_shard_t* shard = &ctx->shards[_hash_sharded_shard_number(ctx, key)];
+	_hash_shard_lock(shard);
+	bool result = hash_table_put(&shard->ctx, key, value);
+	_hash_shard_unlock(shard);
+	return result;
+}
+
+bool hash_sharded_delete(hash_sharded_ctx_t* ctx, uint64_t key, hash_old_value_t* old_value) {
+	hash_shard_t* shard = &ctx->shards[_hash_sharded_shard_number(ctx, key)];
+	_hash_shard_lock(shard);
+	bool result = hash_table_delete(&shard->ctx, key, old_value);
+	_hash_shard_unlock(shard);
+	return result;
+}
+
+bool hash_sharded_upsert(hash_sharded_ctx_t* ctx, uint64_t key, hash_merge_fn_t merge, void* arg) {
+	hash_shard_t* shard = &ctx->shards[_hash_sharded_shard_number(ctx, key)];
+	_hash_shard_lock(shard);
+	bool result = hash_table_upsert(&shard->ctx, key, merge, arg);
+	_hash_shard_unlock(shard);
+	return result;
+}
+
+// counting sort of the key indexes by shard, offsets[s] .. offsets[s + 1] are the positions
+// in order of the keys that belong to shard s
+static uint32_t* _hash_sharded_group(hash_sharded_ctx_t* ctx, const uint64_t* keys, size_t n, uint32_t* offsets) {
+	uint32_t count = (uint32_t)1 << ctx->shard_bits;
+	uint32_t* order = malloc(n * sizeof(uint32_t));
+	if (!order)
+		return NULL;
+
+	memset(offsets, 0, (count + 1) * sizeof(uint32_t));
+	for (size_t i = 0; i < n; i++)
+		offsets[_hash_sharded_shard_number(ctx, keys[i]) + 1]++;
+	for (uint32_t s = 0; s < count; s++)
+		offsets[s + 1] += offsets[s];
+	uint32_t pos[1 << HASH_SHARDED_MAX_BITS];
+	memcpy(pos, offsets, count * sizeof(uint32_t));
+	for (size_t i = 0; i < n; i++)
+		order[pos[_hash_sharded_shard_number(ctx, keys[i])]++] = (uint32_t)i;
+	return order;
+}
+
+size_t hash_sharded_put_batch(hash_sharded_ctx_t* ctx, const uint64_t* keys, const uint64_t* values, size_t n) {
+	uint32_t offsets[(1 << HASH_SHARDED_MAX_BITS) + 1];
+	uint32_t* order = _hash_sharded_group(ctx, keys, n, offsets);
+	if (!order) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	size_t stored = 0;
+	for (uint32_t s = 0; s < ((uint32_t)1 << ctx->shard_bits); s++)
+	{
+		if (offsets[s] == offsets[s + 1])
+			continue;
+		hash_shard_t* shard = &ctx->shards[s];
+		_hash_shard_lock(shard);
+		for (uint32_t i = offsets[s]; i < offsets[s + 1]; i++)
+		{
+			stored += hash_table_put(&shard->ctx, keys[order[i]], values[order[i]]);
+		}
+		_hash_shard_unlock(shard);
+	}
+	free(order);
+	return stored;
+}
+
+size_t hash_sharded_get_batch(hash_sharded_ctx_t* ctx, const uint64_t* keys, size_t n, uint64_t* values, uint64_t* found_bitmap) {
+	uint32_t offsets[(1 << HASH_SHARDED_MAX_BITS) + 1];
+	memset(found_bitmap, 0, ((n + 63) / 64) * sizeof(uint64_t));
+	uint32_t* order = _hash_sharded_group(ctx, keys, n, offsets);
+	// the keys of a shard are gathered so hash_table_get_batch can pipeline them
+	uint64_t* shard_keys = malloc(n * sizeof(uint64_t));
+	uint64_t* shard_values = malloc(n * sizeof(uint64_t));
+	uint64_t* shard_found = malloc(((n + 63) / 64) * sizeof(uint64_t));
+	size_t found = 0;
+	if (!order || !shard_keys || !shard_values || !shard_found) {
+		errno = ENOMEM;
+		goto done;
+	}
+
+	for (uint32_t s = 0; s < ((uint32_t)1 << ctx->shard_bits); s++)
+	{
+		uint32_t start = offsets[s], count = offsets[s + 1] - offsets[s];
+		if (!count)
+			continue;
+		for (uint32_t i = 0; i < count; i++)
+			shard_keys[i] = keys[order[start + i]];
+
+		found += hash_table_get_batch(&ctx->shards[s].ctx, shard_keys, count, shard_values, shard_found);
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (!(shard_found[i / 64] & ((uint64_t)1 << (i % 64))))
+				continue;
+			uint32_t idx = order[start + i];
+			values[idx] = shard_values[i];
+			found_bitmap[idx / 64] |= (uint64_t)1 << (idx % 64);
+		}
+	}
+
+done:
+	free(shard_found);
+	free(shard_values);
+	free(shard_keys);
+	free(order);
+	return found;
+}
+
+void hash_sharded_get_stats(hash_sharded_ctx_t* ctx, hash_stats_t* stats) {
+	memset(stats, 0, sizeof(hash_stats_t));
+	for (uint32_t s = 0; s < ((uint32_t)1 << ctx->shard_bits); s++)
+	{
+		hash_stats_t shard;
+		hash_table_get_stats(&ctx->shards[s].ctx, &shard);
+		uint64_t* sum = (uint64_t*)stats;
+		uint64_t* counters = (uint64_t*)&shard;
+		for (size_t i = 0; i < offsetof(hash_stats_t, depth) / sizeof(uint64_t); i++)
+			sum[i] += counters[i];
+		if (shard.depth > stats->depth)
+			stats->depth = shard.depth;
+	}
+}